@@ -1,12 +1,31 @@
 ﻿// lookup.cpp — self-contained, Windows + POSIX, UTF-8-safe
 // Build with: cl /std:c++17 lookup.cpp sqlite3.c /link sqlite3.lib libcrypto.lib
-// or:       g++ -std=c++17 lookup.cpp -lsqlite3 -lcrypto -o lookup
+// or:       g++ -std=c++17 -pthread lookup.cpp -lsqlite3 -lcrypto -o lookup
+// Add -DLOOKUP_ZLIB -lz and/or -DLOOKUP_ZSTD -lzstd to ingest .gz/.zst files.
+// Add -DLOOKUP_LIBRARY (and -fPIC -shared) to build the engine without main(); see lookup_engine.h.
 
 #ifdef _WIN32
 #include <windows.h>
+#include <intrin.h>
 #else
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#endif
+#endif
+#if defined(__linux__) && !defined(LOOKUP_NO_USDT) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LOOKUP_USDT 1
 #endif
 
 #include <iostream>
@@ -21,6 +40,36 @@
 #include <sqlite3.h>
 #include <openssl/sha.h>
 #include <fstream>
+#include <filesystem>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include "lookup_engine.h"
+#ifdef LOOKUP_ZLIB
+#include <zlib.h>
+#endif
+#ifdef LOOKUP_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
 
 #ifdef _WIN32
 // Convert wide UTF-16 command-line args to UTF-8
@@ -43,6 +92,54 @@ std::string sha256_hex(const std::string& input) {
     return oss.str();
 }
 
+// Lowercase hex of raw bytes
+std::string to_hex(const unsigned char* p, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(2 * n);
+    for (size_t i = 0; i < n; ++i) {
+        out.push_back(hex[p[i] >> 4]);
+        out.push_back(hex[p[i] & 15]);
+    }
+    return out;
+}
+
+// Decode a 64-char hex SHA-256 digest into raw bytes
+bool parse_hex_digest(const char* s, size_t n, unsigned char out[SHA256_DIGEST_LENGTH]) {
+    if (n != SHA256_DIGEST_LENGTH * 2) return false;
+    auto nib = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+        int hi = nib(s[2 * i]), lo = nib(s[2 * i + 1]);
+        if (hi < 0 || lo < 0) return false;
+        out[i] = static_cast<unsigned char>(hi << 4 | lo);
+    }
+    return true;
+}
+
+inline int popcount64(uint64_t x) {
+#ifdef _MSC_VER
+    return static_cast<int>(__popcnt64(x));
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+// Position of the highest set bit; x must not be zero
+inline int highest_bit64(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return static_cast<int>(i);
+#else
+    return 63 - __builtin_clzll(x);
+#endif
+}
+
 // Lowercase helper
 std::string to_lower(const std::string& s) {
     std::string out = s;
@@ -50,6 +147,15 @@ std::string to_lower(const std::string& s) {
     return out;
 }
 
+// Split a comma-separated option value, dropping empty items
+std::vector<std::string> split_list(const std::string& s) {
+    std::vector<std::string> out;
+    std::string item;
+    std::istringstream ss(s);
+    while (std::getline(ss, item, ',')) if (!item.empty()) out.push_back(item);
+    return out;
+}
+
 // Case-insensitive suffix check
 bool ends_with_ci(const std::string& s, const std::string& suf) {
     if (s.size() < suf.size()) return false;
@@ -80,264 +186,5232 @@ std::string json_escape(const std::string& s) {
     return o.str();
 }
 
+// ---- Tracing ----
+// Opt-in timeline of where lookups spend their time, written as Chrome
+// trace-event JSON that loads in Perfetto or chrome://tracing. A TraceSpan
+// records one complete event for its scope into its thread's buffer. With
+// tracing off, a span costs one relaxed atomic load. Buffers outlive
+// their threads so the trace covers everything recorded since the start.
+
+struct TraceEvent {
+    const char* name;
+    std::string detail;
+    int64_t startNs, endNs;
+};
+
+struct TraceBuffer {
+    std::mutex m;               // its own thread and the writer; practically uncontended
+    int tid = 0;
+    std::string threadName;
+    std::vector<TraceEvent> events;
+};
+
+class Tracer {
+public:
+    static const size_t kMaxEvents = size_t(1) << 22;
+
+    bool on() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void start() {
+        t0_ = std::chrono::steady_clock::now();
+        enabled_ = true;
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0_).count();
+    }
+
+    TraceBuffer& buffer() {
+        thread_local TraceBuffer* buf = nullptr;
+        if (!buf) {
+            buf = new TraceBuffer;
+            std::lock_guard<std::mutex> lock(m_);
+            buf->tid = static_cast<int>(buffers_.size()) + 1;
+            buffers_.push_back(buf);
+        }
+        return *buf;
+    }
+
+    void record(const char* name, std::string detail, int64_t startNs, int64_t endNs) {
+        if (recorded_.fetch_add(1, std::memory_order_relaxed) >= kMaxEvents) {
+            if (!full_.exchange(true)) std::cerr << "Trace buffer full; later spans are dropped\n";
+            return;
+        }
+        TraceBuffer& b = buffer();
+        std::lock_guard<std::mutex> lock(b.m);
+        b.events.push_back(TraceEvent{ name, std::move(detail), startNs, endNs });
+    }
+
+    // Write every span so far; the file is replaced atomically
+    bool write(const std::string& path) {
+        std::string tmp = path + ".tmp";
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        auto us = [](int64_t ns) { return std::to_string(ns / 1000) + '.' + std::to_string(1000 + ns % 1000).substr(1); };
+        std::vector<TraceBuffer*> buffers;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            buffers = buffers_;
+        }
+        for (auto* b : buffers) {
+            std::lock_guard<std::mutex> lock(b->m);
+            if (!b->threadName.empty()) {
+                out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+                    << ",\"args\":{\"name\":\"" << json_escape(b->threadName) << "\"}}";
+                first = false;
+            }
+            for (auto& e : b->events) {
+                out << (first ? "" : ",\n") << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                    << ",\"ts\":" << us(e.startNs) << ",\"dur\":" << us(e.endNs - e.startNs);
+                if (!e.detail.empty()) out << ",\"args\":{\"detail\":\"" << json_escape(e.detail) << "\"}";
+                out << '}';
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        out.close();
+        std::error_code ec;
+        if (out) std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+        if (!out || ec) { std::cerr << "Cannot write " << path << "\n"; return false; }
+        return true;
+    }
+
+private:
+    std::atomic<bool> enabled_{ false };
+    std::atomic<bool> full_{ false };
+    std::atomic<size_t> recorded_{ 0 };
+    std::chrono::steady_clock::time_point t0_;
+    std::mutex m_;
+    std::vector<TraceBuffer*> buffers_;
+};
+
+// Never destroyed: detached threads may still record at exit
+Tracer& tracer() {
+    static auto* t = new Tracer;
+    return *t;
+}
+
+// Name the calling thread in the trace
+void trace_thread_name(const std::string& name) {
+    if (!tracer().on()) return;
+    TraceBuffer& b = tracer().buffer();
+    std::lock_guard<std::mutex> lock(b.m);
+    b.threadName = name;
+}
+
+// Rewrite the trace file of a running server every few seconds
+void dump_trace(std::string path) {
+    for (;;) {
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+        tracer().write(path);
+    }
+}
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name_(tracer().on() ? name : nullptr) {
+        if (name_) startNs_ = tracer().now();
+    }
+    TraceSpan(const char* name, const std::string& detail) : TraceSpan(name) {
+        if (name_) detail_ = detail;
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    ~TraceSpan() {
+        if (name_) tracer().record(name_, std::move(detail_), startNs_, tracer().now());
+    }
+
+private:
+    const char* name_;
+    std::string detail_;
+    int64_t startNs_ = 0;
+};
+
+// ---- Static probes ----
+// USDT probes for profiling live processes with bpftrace, perf or SystemTap,
+// e.g. bpftrace -e 'usdt:./DB_Lookup:lookup:query__done { @rows = hist(arg1); }'.
+// Each probe compiles to a single nop plus an ELF note and costs nothing
+// until a tracer attaches. Built only on Linux when <sys/sdt.h> is present
+// (systemtap-sdt-dev); elsewhere, or with -DLOOKUP_NO_USDT, they vanish.
+//   query__start(mode, query)      query__done(mode, rows)
+//   prepare__start(sql)            prepare__done(rc)
+//   fetch__start()                 fetch__done(rows)      one sqlite3_step loop
+//   cache__hit(kind)               cache__miss(kind)      kind: mphf, prefix, cuckoo, coalesce
+//   output__flush(bytes)          one server response written to the socket or ring
+#ifdef LOOKUP_USDT
+#define LOOKUP_PROBE0(name) DTRACE_PROBE(lookup, name)
+#define LOOKUP_PROBE1(name, a) DTRACE_PROBE1(lookup, name, a)
+#define LOOKUP_PROBE2(name, a, b) DTRACE_PROBE2(lookup, name, a, b)
+#else
+#define LOOKUP_PROBE0(name) do {} while (0)
+#define LOOKUP_PROBE1(name, a) do {} while (0)
+#define LOOKUP_PROBE2(name, a, b) do {} while (0)
+#endif
+
 // Collect rows from prepared statement
 std::vector<std::map<std::string, std::string>> collect_rows(sqlite3_stmt* stmt) {
+    TraceSpan trace("fetch rows");
+    LOOKUP_PROBE0(fetch__start);
     std::vector<std::map<std::string, std::string>> rows;
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         std::map<std::string, std::string> row;
         int cols = sqlite3_column_count(stmt);
         for (int i = 0; i < cols; ++i) {
             const char* name = sqlite3_column_name(stmt, i);
+            if (sqlite3_column_type(stmt, i) == SQLITE_BLOB) {
+                // Packed digests and other binary values are shown as hex
+                row[name] = to_hex(static_cast<const unsigned char*>(sqlite3_column_blob(stmt, i)), static_cast<size_t>(sqlite3_column_bytes(stmt, i)));
+                continue;
+            }
             const unsigned char* val = sqlite3_column_text(stmt, i);
             row[name] = val ? reinterpret_cast<const char*>(val) : std::string();
         }
         rows.push_back(std::move(row));
     }
+    LOOKUP_PROBE1(fetch__done, static_cast<int64_t>(rows.size()));
     return rows;
 }
 
-// Lookup by phone (international, any country)
-std::vector<std::map<std::string, std::string>> lookup_by_phone(sqlite3* db, const std::string& table, const std::string& phone) {
-    // Strip non-digit characters, preserve '+' if present
-    bool has_plus = false;
-    std::string digits;
-    for (unsigned char c : phone) {
-        if (c == '+') has_plus = true;
-        if (std::isdigit(c)) digits.push_back(c);
+// Prepare a lookup statement, traced as its own span
+int prepare_statement(sqlite3* db, const std::string& sql, sqlite3_stmt** st) {
+    TraceSpan trace("prepare");
+    LOOKUP_PROBE1(prepare__start, sql.c_str());
+    int rc = sqlite3_prepare_v2(db, sql.c_str(), -1, st, nullptr);
+    LOOKUP_PROBE1(prepare__done, rc);
+    return rc;
+}
+
+// Run a statement without results, reporting failures on stderr
+bool exec_sql(sqlite3* db, const std::string& sql) {
+    char* err = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) == SQLITE_OK) return true;
+    std::cerr << (err ? err : sqlite3_errmsg(db)) << "\n";
+    sqlite3_free(err);
+    return false;
+}
+
+// ---- SQL functions ----
+// sha256(x) returns the 32-byte digest, sha256_hex(x) its lowercase hex form,
+// phone_canon(x) the '+'-prefixed digits of a phone number, digest_in(h, d)
+// tests a packed row_hashes blob. The first three let a table
+// keep only source columns and index ON t(sha256_hex(col)) or derive digests
+// as generated columns. Every connection that reads or writes such a table
+// must register them, so all opens go through open_database.
+
+void sql_sha256(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) { sqlite3_result_null(ctx); return; }
+    const unsigned char* p = sqlite3_value_type(argv[0]) == SQLITE_BLOB
+        ? static_cast<const unsigned char*>(sqlite3_value_blob(argv[0])) : sqlite3_value_text(argv[0]);
+    int n = sqlite3_value_bytes(argv[0]);
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256(p ? p : reinterpret_cast<const unsigned char*>(""), static_cast<size_t>(n), hash);
+    if (sqlite3_user_data(ctx)) {
+        static const char hex[] = "0123456789abcdef";
+        char out[SHA256_DIGEST_LENGTH * 2];
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
+            out[2 * i] = hex[hash[i] >> 4];
+            out[2 * i + 1] = hex[hash[i] & 15];
+        }
+        sqlite3_result_text(ctx, out, sizeof(out), SQLITE_TRANSIENT);
     }
-    // Build variants: always try both with and without '+' prefix
-    std::vector<std::string> variants;
-    if (has_plus) {
-        variants.push_back("+" + digits);
-        variants.push_back(digits);
+    else sqlite3_result_blob(ctx, hash, SHA256_DIGEST_LENGTH, SQLITE_TRANSIENT);
+}
+
+// Index of a 32-byte digest in a packed array of digests, or -1.
+// One vector compare per entry where AVX2, SSE2 or NEON is available.
+long long find_packed_digest(const unsigned char* p, size_t n, const unsigned char* d) {
+    size_t count = n / SHA256_DIGEST_LENGTH;
+#if defined(__AVX2__)
+    const __m256i key = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d));
+    for (size_t i = 0; i < count; ++i) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i * SHA256_DIGEST_LENGTH));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, key)) == -1) return static_cast<long long>(i);
     }
-    else {
-        variants.push_back(digits);
-        variants.push_back("+" + digits);
+#elif defined(__SSE2__) || defined(_M_X64)
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + 16));
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* e = p + i * SHA256_DIGEST_LENGTH;
+        __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(e)), lo),
+            _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(e + 16)), hi));
+        if (_mm_movemask_epi8(eq) == 0xFFFF) return static_cast<long long>(i);
     }
-    // Compute hashes for each variant
-    std::vector<std::string> hashes;
-    for (auto& v : variants) hashes.push_back(sha256_hex(v));
-
-    // Get SHA columns from table
-    sqlite3_stmt* cols;
-    std::string pr = "PRAGMA table_info('" + table + "');";
-    sqlite3_prepare_v2(db, pr.c_str(), -1, &cols, nullptr);
-    std::vector<std::string> shaCols;
-    while (sqlite3_step(cols) == SQLITE_ROW) {
-        std::string col = reinterpret_cast<const char*>(sqlite3_column_text(cols, 1));
-        if (ends_with_ci(col, "_sha") || ends_with_ci(col, "_sha256")) shaCols.push_back(col);
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    const uint8x16_t lo = vld1q_u8(d), hi = vld1q_u8(d + 16);
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* e = p + i * SHA256_DIGEST_LENGTH;
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(e), lo), vceqq_u8(vld1q_u8(e + 16), hi));
+        if (vminvq_u8(eq) == 0xFF) return static_cast<long long>(i);
     }
-    sqlite3_finalize(cols);
-    if (shaCols.empty()) return {};
+#else
+    for (size_t i = 0; i < count; ++i)
+        if (std::memcmp(p + i * SHA256_DIGEST_LENGTH, d, SHA256_DIGEST_LENGTH) == 0) return static_cast<long long>(i);
+#endif
+    return -1;
+}
 
-    // Build query with placeholders
-    std::ostringstream ss;
-    ss << "SELECT * FROM '" << table << "' WHERE ";
-    for (size_t i = 0; i < shaCols.size(); ++i) {
-        if (i) ss << " OR ";
-        ss << '"' << shaCols[i] << '"' << " IN (";
-        for (size_t j = 0; j < hashes.size(); ++j) {
-            if (j) ss << ',';
-            ss << '?';
+// digest_in(hashes, digest): 1 when a packed row_hashes blob holds the
+// digest, given as a 32-byte blob or hex text; NULL if either is NULL
+void sql_digest_in(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+    unsigned char d[SHA256_DIGEST_LENGTH];
+    if (sqlite3_value_type(argv[1]) == SQLITE_BLOB && sqlite3_value_bytes(argv[1]) == SHA256_DIGEST_LENGTH)
+        std::memcpy(d, sqlite3_value_blob(argv[1]), SHA256_DIGEST_LENGTH);
+    else {
+        const char* h = reinterpret_cast<const char*>(sqlite3_value_text(argv[1]));
+        if (!h || !parse_hex_digest(h, static_cast<size_t>(sqlite3_value_bytes(argv[1])), d)) {
+            sqlite3_result_int(ctx, 0);
+            return;
         }
-        ss << ')';
     }
+    const void* p = sqlite3_value_blob(argv[0]);
+    size_t n = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+    sqlite3_result_int(ctx, p && find_packed_digest(static_cast<const unsigned char*>(p), n, d) >= 0);
+}
+
+void sql_phone_canon(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const unsigned char* p = sqlite3_value_text(argv[0]);
+    std::string out = "+";
+    for (; p && *p; ++p)
+        if (std::isdigit(*p)) out.push_back(static_cast<char>(*p));
+    if (out.size() == 1) sqlite3_result_null(ctx);
+    else sqlite3_result_text(ctx, out.c_str(), static_cast<int>(out.size()), SQLITE_TRANSIENT);
+}
+
+bool register_lookup_functions(sqlite3* db) {
+    int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+#ifdef SQLITE_INNOCUOUS
+    flags |= SQLITE_INNOCUOUS;
+#endif
+    static int hexTag = 1;
+    return sqlite3_create_function(db, "sha256", 1, flags, nullptr, sql_sha256, nullptr, nullptr) == SQLITE_OK
+        && sqlite3_create_function(db, "sha256_hex", 1, flags, &hexTag, sql_sha256, nullptr, nullptr) == SQLITE_OK
+        && sqlite3_create_function(db, "phone_canon", 1, flags, nullptr, sql_phone_canon, nullptr, nullptr) == SQLITE_OK
+        && sqlite3_create_function(db, "digest_in", 2, flags, nullptr, sql_digest_in, nullptr, nullptr) == SQLITE_OK;
+}
+
+// Open a connection with the lookup SQL functions registered.
+// On failure the error is printed and db is closed.
+bool open_database(const std::string& path, int flags, sqlite3** db) {
+    TraceSpan trace("open", path);
+    if (sqlite3_open_v2(path.c_str(), db, flags, nullptr) == SQLITE_OK && register_lookup_functions(*db)) {
+        // Ride out WAL recovery and checkpoints instead of failing with SQLITE_BUSY
+        sqlite3_busy_timeout(*db, 5000);
+        return true;
+    }
+    std::cerr << sqlite3_errmsg(*db) << "\n";
+    sqlite3_close(*db);
+    *db = nullptr;
+    return false;
+}
+
+// Current journal mode of a connection's main database, lowercase
+std::string journal_mode(sqlite3* db) {
     sqlite3_stmt* st;
-    sqlite3_prepare_v2(db, ss.str().c_str(), -1, &st, nullptr);
-    int idx = 1;
-    for (auto& col : shaCols) for (auto& h : hashes) sqlite3_bind_text(st, idx++, h.c_str(), -1, SQLITE_TRANSIENT);
-    auto rows = collect_rows(st);
+    std::string mode;
+    if (sqlite3_prepare_v2(db, "PRAGMA journal_mode", -1, &st, nullptr) != SQLITE_OK) return mode;
+    if (sqlite3_step(st) == SQLITE_ROW) mode = to_lower(reinterpret_cast<const char*>(sqlite3_column_text(st, 0)));
     sqlite3_finalize(st);
-    return rows;
+    return mode;
 }
 
-// Lookup by address
-std::vector<std::map<std::string, std::string>> lookup_by_address(sqlite3* db, const std::string& table, const std::string& q) {
+// Puts a database in WAL mode for a maintenance run so lookups and the
+// server keep reading consistent snapshots while it writes. Commits no
+// longer checkpoint inline; a background thread on its own connection
+// runs passive checkpoints, which never wait for readers, and the WAL is
+// truncated once the writer is done.
+class WalCheckpointer {
+public:
+    ~WalCheckpointer() { stop(); }
+
+    bool start(sqlite3* db, const std::string& path) {
+        if (journal_mode(db) != "wal") exec_sql(db, "PRAGMA journal_mode=WAL");
+        if (journal_mode(db) != "wal") { std::cerr << "Cannot switch " << path << " to WAL mode\n"; return false; }
+        exec_sql(db, "PRAGMA synchronous=NORMAL");
+        exec_sql(db, "PRAGMA wal_autocheckpoint=0");
+        db_ = db;
+        running_ = true;
+        worker_ = std::thread([this, path]() {
+            sqlite3* conn;
+            if (!open_database(path, SQLITE_OPEN_READWRITE, &conn)) return;
+            std::unique_lock<std::mutex> lock(m_);
+            while (!cv_.wait_for(lock, std::chrono::milliseconds(500), [this] { return !running_; }))
+                sqlite3_wal_checkpoint_v2(conn, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+            sqlite3_close(conn);
+        });
+        return true;
+    }
+
+    void stop() {
+        if (!db_) return;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            running_ = false;
+        }
+        cv_.notify_all();
+        worker_.join();
+        // Readers may still pin old frames; then the WAL is truncated next time
+        if (sqlite3_wal_checkpoint_v2(db_, nullptr, SQLITE_CHECKPOINT_TRUNCATE, nullptr, nullptr) != SQLITE_OK)
+            sqlite3_wal_checkpoint_v2(db_, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+        exec_sql(db_, "PRAGMA wal_autocheckpoint=1000");
+        db_ = nullptr;
+    }
+
+private:
+    sqlite3* db_ = nullptr;
+    std::thread worker_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool running_ = false;
+};
+
+// Identity of a database file, checked without opening it in SQLite.
+// The header change counter (offset 24) is the on-disk counterpart of
+// PRAGMA data_version; the -wal file covers commits not yet checkpointed.
+struct FileStamp {
+    long long size = -1;
+    long long mtime = 0;
+    unsigned long changeCounter = 0;
+    long long walSize = -1;
+    long long walMtime = 0;
+
+    bool operator==(const FileStamp& o) const {
+        return size == o.size && mtime == o.mtime && changeCounter == o.changeCounter &&
+            walSize == o.walSize && walMtime == o.walMtime;
+    }
+    bool operator!=(const FileStamp& o) const { return !(*this == o); }
+};
+
+FileStamp read_file_stamp(const std::string& path) {
+    namespace fs = std::filesystem;
+    FileStamp st;
+    std::error_code ec;
+    fs::path p = fs::u8path(path);
+    auto size = fs::file_size(p, ec);
+    if (ec) return st;
+    st.size = static_cast<long long>(size);
+    st.mtime = static_cast<long long>(fs::last_write_time(p, ec).time_since_epoch().count());
+    std::ifstream f(p, std::ios::binary);
+    unsigned char hdr[28] = {};
+    if (f.read(reinterpret_cast<char*>(hdr), sizeof(hdr)))
+        st.changeCounter = (unsigned long)hdr[24] << 24 | (unsigned long)hdr[25] << 16 | (unsigned long)hdr[26] << 8 | hdr[27];
+    // An empty WAL holds no frames; every connection that opens the
+    // database recreates it, so its mtime says nothing about the contents
+    fs::path wal = fs::u8path(path + "-wal");
+    auto walSize = fs::file_size(wal, ec);
+    if (!ec && walSize > 0) {
+        st.walSize = static_cast<long long>(walSize);
+        st.walMtime = static_cast<long long>(fs::last_write_time(wal, ec).time_since_epoch().count());
+    }
+    return st;
+}
+
+// Digest computed by an expression index, e.g. ON t(sha256_hex(phone))
+struct DigestExpr {
+    std::string expr;                     // key expression, verbatim from the index
+    std::string where;                    // partial index predicate, if any
+    bool blob = false;                    // sha256() yields raw bytes, sha256_hex() text
+};
+
+// Column roles of a lookup table
+struct TableSchema {
+    std::vector<std::string> shaCols;     // *_sha / *_sha256 digest columns, stored or generated
+    std::vector<std::string> addrCols;    // address-like text columns
+    std::vector<std::string> indexedCols; // digest columns leading an index
+    std::vector<DigestExpr> exprCols;     // expression indexes over sha256()/sha256_hex()
+    bool hasJson = false;                 // row_hashes JSON array column
+    bool packedHashes = false;            // row_hashes holds concatenated 32-byte digests instead
+    std::string digestTable;              // <table>_digests companion, after reorganize
+};
+
+// Split "CREATE INDEX ... ON t (<expr>, ...) [WHERE <pred>]" into its first
+// key expression and predicate. Quotes are skipped when matching parens.
+bool parse_index_sql(const std::string& sql, std::string& first, std::string& where) {
+    std::string lc = to_lower(sql);
+    size_t on = lc.find(" on ");
+    size_t open = on == std::string::npos ? on : sql.find('(', on);
+    if (open == std::string::npos) return false;
+    int depth = 0;
+    char quote = 0;
+    size_t comma = std::string::npos, close = std::string::npos;
+    for (size_t i = open; i < sql.size() && close == std::string::npos; ++i) {
+        char c = sql[i];
+        if (quote) { if (c == quote) quote = 0; continue; }
+        if (c == '\'' || c == '"' || c == '`') quote = c;
+        else if (c == '[') quote = ']';
+        else if (c == '(') ++depth;
+        else if (c == ')' && --depth == 0) close = i;
+        else if (c == ',' && depth == 1 && comma == std::string::npos) comma = i;
+    }
+    if (close == std::string::npos) return false;
+    first = sql.substr(open + 1, std::min(comma, close) - open - 1);
+    for (const char* suffix : { " asc", " desc" })
+        if (ends_with_ci(first, suffix)) first.erase(first.size() - std::strlen(suffix));
+    first.erase(0, first.find_first_not_of(" \t\r\n"));
+    first.erase(first.find_last_not_of(" \t\r\n") + 1);
+    size_t w = lc.find("where", close);
+    where = w == std::string::npos ? "" : sql.substr(w + 5);
+    where.erase(0, where.find_first_not_of(" \t\r\n"));
+    while (!where.empty() && (where.back() == ';' || std::isspace(static_cast<unsigned char>(where.back())))) where.pop_back();
+    for (auto* part : { &first, &where })
+        for (auto& c : *part) if (c == '\t' || c == '\n' || c == '\r') c = ' ';
+    return true;
+}
+
+// Read column roles and index presence from SQLite
+TableSchema read_table_schema(sqlite3* db, const std::string& table) {
+    TableSchema schema;
     sqlite3_stmt* cols;
-    std::string pr = "PRAGMA table_info('" + table + "');";
-    sqlite3_prepare_v2(db, pr.c_str(), -1, &cols, nullptr);
-    std::vector<std::string> addrCols;
+    // table_xinfo also lists generated columns (hidden 2 and 3)
+    std::string pr = "PRAGMA table_xinfo('" + table + "');";
+    if (sqlite3_prepare_v2(db, pr.c_str(), -1, &cols, nullptr) != SQLITE_OK) return schema;
     while (sqlite3_step(cols) == SQLITE_ROW) {
+        if (sqlite3_column_int(cols, 6) == 1) continue;
         std::string col = reinterpret_cast<const char*>(sqlite3_column_text(cols, 1));
         auto lc = to_lower(col);
+        if (col == "row_hashes") schema.hasJson = true;
+        if (ends_with_ci(col, "_sha") || ends_with_ci(col, "_sha256")) schema.shaCols.push_back(col);
         if (lc.find("addr") != std::string::npos || lc.find("street") != std::string::npos || lc.find("city") != std::string::npos)
-            addrCols.push_back(col);
+            schema.addrCols.push_back(col);
     }
     sqlite3_finalize(cols);
-    std::vector<std::map<std::string, std::string>> result;
-    for (auto& col : addrCols) {
-        std::string sql = "SELECT *, '" + col + "' AS matched_col FROM '" + table + "' WHERE lower(\"" + col + "\") LIKE lower(?)";
-        sqlite3_stmt* st;
-        sqlite3_prepare_v2(db, sql.c_str(), -1, &st, nullptr);
-        std::string pat = "%" + q + "%";
-        sqlite3_bind_text(st, 1, pat.c_str(), -1, SQLITE_TRANSIENT);
-        auto rows = collect_rows(st);
-        sqlite3_finalize(st);
-        result.insert(result.end(), rows.begin(), rows.end());
-    }
-    return result;
-}
 
-// Lookup by hash
-static std::vector<std::map<std::string, std::string>> lookup_by_hash(
-    sqlite3* db,
-    const std::string& tbl,
-    const std::string& raw
-) {
-    std::string h = sha256_hex(raw);
-
-    // Determine JSON array column and SHA columns
-    sqlite3_stmt* cols_stmt;
-    sqlite3_prepare_v2(db, ("PRAGMA table_info('" + tbl + "');").c_str(), -1, &cols_stmt, nullptr);
-    bool hasJson = false;
-    std::vector<std::string> shaCols;
-    while (sqlite3_step(cols_stmt) == SQLITE_ROW) {
-        std::string colName = reinterpret_cast<const char*>(sqlite3_column_text(cols_stmt, 1));
-        if (colName == "row_hashes") hasJson = true;
-        if (ends_with_ci(colName, "_sha") || ends_with_ci(colName, "_sha256")) {
-            shaCols.push_back(colName);
+    std::vector<std::string> indexes;
+    sqlite3_stmt* il;
+    pr = "PRAGMA index_list('" + table + "');";
+    if (sqlite3_prepare_v2(db, pr.c_str(), -1, &il, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(il) == SQLITE_ROW)
+            indexes.push_back(reinterpret_cast<const char*>(sqlite3_column_text(il, 1)));
+        sqlite3_finalize(il);
+    }
+    for (auto& idx : indexes) {
+        sqlite3_stmt* ii;
+        pr = "PRAGMA index_info('" + idx + "');";
+        if (sqlite3_prepare_v2(db, pr.c_str(), -1, &ii, nullptr) != SQLITE_OK) continue;
+        if (sqlite3_step(ii) == SQLITE_ROW && sqlite3_column_int(ii, 0) == 0 && sqlite3_column_text(ii, 2)) {
+            std::string col = reinterpret_cast<const char*>(sqlite3_column_text(ii, 2));
+            if (std::find(schema.shaCols.begin(), schema.shaCols.end(), col) != schema.shaCols.end() &&
+                std::find(schema.indexedCols.begin(), schema.indexedCols.end(), col) == schema.indexedCols.end())
+                schema.indexedCols.push_back(col);
         }
+        sqlite3_finalize(ii);
     }
-    sqlite3_finalize(cols_stmt);
 
-    std::vector<std::map<std::string, std::string>> out;
-
-    // JSON array lookup
-    if (hasJson) {
-        std::string jsql =
-            "SELECT t.* FROM '" + tbl + "' t, json_each(t.row_hashes) je WHERE je.value = ?";
-        sqlite3_stmt* js;
-        sqlite3_prepare_v2(db, jsql.c_str(), -1, &js, nullptr);
-        sqlite3_bind_text(js, 1, h.c_str(), -1, SQLITE_TRANSIENT);
-        auto jrows = collect_rows(js);
-        sqlite3_finalize(js);
-        out.insert(out.end(), jrows.begin(), jrows.end());
+    if (schema.hasJson) {
+        // pack-row-hashes converts a whole table at once, so one row tells the format
+        sqlite3_stmt* ty;
+        std::string q = "SELECT typeof(row_hashes) FROM '" + table + "' WHERE row_hashes IS NOT NULL LIMIT 1";
+        if (sqlite3_prepare_v2(db, q.c_str(), -1, &ty, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(ty) == SQLITE_ROW)
+                schema.packedHashes = std::strcmp(reinterpret_cast<const char*>(sqlite3_column_text(ty, 0)), "blob") == 0;
+            sqlite3_finalize(ty);
+        }
     }
 
-    // Direct SHA column lookup
-    if (!shaCols.empty()) {
-        std::ostringstream qss;
-        qss << "SELECT * FROM '" << tbl << "' WHERE ";
-        for (size_t i = 0; i < shaCols.size(); ++i) {
-            if (i) qss << " OR ";
-            qss << '"' << shaCols[i] << '"' << " = ?";
-        }
-        sqlite3_stmt* ss;
-        sqlite3_prepare_v2(db, qss.str().c_str(), -1, &ss, nullptr);
-        for (size_t i = 0; i < shaCols.size(); ++i) {
-            sqlite3_bind_text(ss, static_cast<int>(i + 1), h.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_stmt* ix;
+    if (sqlite3_prepare_v2(db, "SELECT sql FROM sqlite_master WHERE type = 'index' AND tbl_name = ? AND sql IS NOT NULL", -1, &ix, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(ix, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+        while (sqlite3_step(ix) == SQLITE_ROW) {
+            DigestExpr e;
+            if (!parse_index_sql(reinterpret_cast<const char*>(sqlite3_column_text(ix, 0)), e.expr, e.where)) continue;
+            std::string lc = to_lower(e.expr);
+            if (lc.rfind("sha256_hex(", 0) == 0) e.blob = false;
+            else if (lc.rfind("sha256(", 0) == 0) e.blob = true;
+            else continue;
+            schema.exprCols.push_back(e);
         }
-        auto srows = collect_rows(ss);
-        sqlite3_finalize(ss);
-        out.insert(out.end(), srows.begin(), srows.end());
+        sqlite3_finalize(ix);
     }
 
-    return out;
+    sqlite3_stmt* dt;
+    if (sqlite3_prepare_v2(db, "SELECT name FROM sqlite_master WHERE type = 'table' AND name = ?", -1, &dt, nullptr) == SQLITE_OK) {
+        std::string name = table + "_digests";
+        sqlite3_bind_text(dt, 1, name.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(dt) == SQLITE_ROW) schema.digestTable = name;
+        sqlite3_finalize(dt);
+    }
+    return schema;
 }
 
-// JSON writing — Windows
+// Sidecar catalog: <db>.catalog caches the schema of every table looked up
+// so far, valid only while the database stamp is unchanged. Format is one
+// tab-separated record per line.
+std::string catalog_path(const std::string& dbFile) { return dbFile + ".catalog"; }
+
+// Temporary name next to path that no other process or thread writes to
+std::string unique_temp_path(const std::string& path) {
+    static std::atomic<unsigned> seq{ 0 };
 #ifdef _WIN32
-bool write_json_windows(const std::wstring& wpath, const std::vector<std::map<std::string, std::string>>& rows) {
-    std::string pathUtf8 = utf8_from_wide(wpath);
-    FILE* f = nullptr;
-    if (_wfopen_s(&f, wpath.c_str(), L"wb, ccs=UTF-8") || !f) {
-        std::cerr << "Cannot open " << pathUtf8 << "\n";
-        return false;
+    unsigned long pid = GetCurrentProcessId();
+#else
+    long pid = static_cast<long>(getpid());
+#endif
+    return path + "." + std::to_string(pid) + "-" + std::to_string(seq.fetch_add(1)) + ".tmp";
+}
+
+bool load_catalog(const std::string& dbFile, const FileStamp& stamp, std::map<std::string, TableSchema>& out) {
+    std::ifstream in(std::filesystem::u8path(catalog_path(dbFile)), std::ios::binary);
+    if (!in) return false;
+    std::string line;
+    if (!std::getline(in, line) || line != "lookup-catalog\t3") return false;
+    FileStamp saved;
+    if (!std::getline(in, line)) return false;
+    {
+        std::istringstream ss(line);
+        std::string tag;
+        ss >> tag >> saved.size >> saved.mtime >> saved.changeCounter >> saved.walSize >> saved.walMtime;
+        if (tag != "stamp" || !ss || saved != stamp) return false;
     }
-    fputc('[', f);
-    for (size_t i = 0; i < rows.size(); ++i) {
-        fputc('{', f);
-        bool first = true;
-        for (auto& kv : rows[i]) {
-            if (!first) fputc(',', f);
-            std::string ent = "\"" + json_escape(kv.first) + "\":\"" + json_escape(kv.second) + "\"";
-            fwrite(ent.c_str(), 1, ent.size(), f);
-            first = false;
+    TableSchema* cur = nullptr;
+    while (std::getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        std::string tag = line.substr(0, tab), val = line.substr(tab + 1);
+        if (tag == "table") cur = &out[val];
+        else if (!cur) return false;
+        else if (tag == "digest") cur->shaCols.push_back(val);
+        else if (tag == "address") cur->addrCols.push_back(val);
+        else if (tag == "index") cur->indexedCols.push_back(val);
+        else if (tag == "row_hashes") { cur->hasJson = true; cur->packedHashes = val == "packed"; }
+        else if (tag == "digest_table") cur->digestTable = val;
+        else if (tag == "expr") {
+            DigestExpr e;
+            std::istringstream es(val);
+            std::string kind;
+            std::getline(es, kind, '\t');
+            std::getline(es, e.expr, '\t');
+            std::getline(es, e.where);
+            e.blob = kind == "blob";
+            cur->exprCols.push_back(e);
         }
-        fputc('}', f);
-        if (i + 1 < rows.size()) fputc(',', f);
     }
-    fputc(']', f);
-    fclose(f);
-    std::cout << "Wrote " << pathUtf8 << "\n";
     return true;
 }
-#endif
 
-// JSON writing — POSIX
-bool write_json_posix(const std::string& path, const std::vector<std::map<std::string, std::string>>& rows) {
-    std::ofstream ofs(path, std::ios::binary);
-    if (!ofs) { std::cerr << "Cannot open " << path << "\n"; return false; }
-    ofs << '[';
-    for (size_t i = 0; i < rows.size(); ++i) {
-        ofs << '{';
-        bool first = true;
-        for (auto& kv : rows[i]) {
-            if (!first) ofs << ',';
-            ofs << '"' << json_escape(kv.first) << "\":\"" << json_escape(kv.second) << '"';
-            first = false;
+bool save_catalog(const std::string& dbFile, const FileStamp& stamp, const std::map<std::string, TableSchema>& tables) {
+    // Concurrent writers each fill their own file; the last rename wins whole
+    std::string path = catalog_path(dbFile), tmp = unique_temp_path(path);
+    std::error_code ec;
+    {
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out << "lookup-catalog\t3\n";
+        out << "stamp " << stamp.size << ' ' << stamp.mtime << ' ' << stamp.changeCounter << ' '
+            << stamp.walSize << ' ' << stamp.walMtime << "\n";
+        for (auto& t : tables) {
+            out << "table\t" << t.first << "\n";
+            for (auto& c : t.second.shaCols) out << "digest\t" << c << "\n";
+            for (auto& c : t.second.addrCols) out << "address\t" << c << "\n";
+            for (auto& c : t.second.indexedCols) out << "index\t" << c << "\n";
+            if (t.second.hasJson) out << "row_hashes\t" << (t.second.packedHashes ? "packed" : "json") << "\n";
+            if (!t.second.digestTable.empty()) out << "digest_table\t" << t.second.digestTable << "\n";
+            for (auto& e : t.second.exprCols)
+                out << "expr\t" << (e.blob ? "blob" : "hex") << '\t' << e.expr << '\t' << e.where << "\n";
+        }
+        out.close();
+        if (!out) {
+            std::filesystem::remove(std::filesystem::u8path(tmp), ec);
+            return false;
         }
-        ofs << '}';
-        if (i + 1 < rows.size()) ofs << ',';
     }
-    ofs << ']';
-    ofs.close();
-    std::cout << "Wrote " << path << "\n";
-    return true;
+    std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+    if (ec) std::filesystem::remove(std::filesystem::u8path(tmp), ec);
+    return !ec;
 }
 
-// main logic
-int run(int argc, char** argv) {
-    std::setlocale(LC_ALL, "");
-    if (argc < 5) { std::cerr << "Usage:<exe> <db> <table> <mode> [--json] <query>\n"; return 1; }
-    int i = 1;
-    const char* dbFile = argv[i++];
-    std::string table = argv[i++];
-    std::string mode = argv[i++];
-    bool jsonOut = false;
-    if (std::string(argv[i]) == "--json") { jsonOut = true; i++; }
-    std::string query = argv[i];
+// Schema of a table, from the sidecar catalog when it is still valid
+TableSchema get_table_schema(sqlite3* db, const std::string& dbFile, const std::string& table) {
+    TraceSpan trace("schema", table);
+    FileStamp stamp = read_file_stamp(dbFile);
+    std::map<std::string, TableSchema> tables;
+    if (stamp.size >= 0 && load_catalog(dbFile, stamp, tables)) {
+        auto it = tables.find(table);
+        if (it != tables.end()) return it->second;
+    }
+    else tables.clear();
+    TableSchema schema = read_table_schema(db, table);
+    if (stamp.size >= 0) {
+        tables[table] = schema;
+        save_catalog(dbFile, stamp, tables);
+    }
+    return schema;
+}
 
-    sqlite3* db;
-    if (sqlite3_open(dbFile, &db) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
-    std::vector<std::map<std::string, std::string>> rows;
-    if (mode == "phone") rows = lookup_by_phone(db, table, query);
-    else if (mode == "address") rows = lookup_by_address(db, table, query);
-    else if (mode == "hash") rows = lookup_by_hash(db, table, query);
-    else { std::cerr << "Unknown mode\n"; sqlite3_close(db); return 1; }
-    sqlite3_close(db);
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
 
-    if (jsonOut) {
+    bool open(const std::string& path) {
+        close();
 #ifdef _WIN32
-        CreateDirectoryW(L"static", nullptr);
-        int wlen = MultiByteToWideChar(CP_UTF8, 0, query.c_str(), -1, nullptr, 0);
-        std::wstring wq(wlen, L'\0');
-        MultiByteToWideChar(CP_UTF8, 0, query.c_str(), -1, &wq[0], wlen);
-        // sanitize
-        std::wstring safe;
-        for (wchar_t c : wq) safe += (iswalnum(c) || c == L' ' || c == L'_') ? c : L'_';
-        std::wstring wpath = L"static\\" + safe + L".json";
-        write_json_windows(wpath, rows);
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+        std::wstring wpath(wlen, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wpath[0], wlen);
+        file_ = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER sz;
+        if (!GetFileSizeEx(file_, &sz) || sz.QuadPart == 0) { close(); return false; }
+        mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_) { close(); return false; }
+        data_ = static_cast<const unsigned char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (!data_) { close(); return false; }
+        size_ = static_cast<size_t>(sz.QuadPart);
 #else
-        mkdir("static", 0755);
-        std::string safe;
-        for (unsigned char c : query) safe += isalnum(c) ? c : '_';
-        std::string path = "static/" + safe + ".json";
-        write_json_posix(path, rows);
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) return false;
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || st.st_size == 0) { close(); return false; }
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) { close(); return false; }
+        data_ = static_cast<const unsigned char*>(p);
+        size_ = static_cast<size_t>(st.st_size);
 #endif
+        return true;
     }
-    else {
-        for (auto& r : rows) {
-            std::cout << "---- Row ----\n";
-            for (auto& kv : r) std::cout << kv.first << ": " << kv.second << "\n";
-        }
+
+    void close() {
+#ifdef _WIN32
+        if (data_) UnmapViewOfFile(data_);
+        if (mapping_) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+        mapping_ = nullptr;
+        file_ = INVALID_HANDLE_VALUE;
+#else
+        if (data_) munmap(const_cast<unsigned char*>(data_), size_);
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+#endif
+        data_ = nullptr;
+        size_ = 0;
     }
-    return 0;
-}
 
+    const unsigned char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
 #ifdef _WIN32
-int wmain(int argc, wchar_t** wargv) {
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
+
+// Visit every (rowid, raw digest) pair stored in a table's digest columns
+// and row_hashes arrays. Digests may be stored as hex text or 32-byte blobs.
+// range(col) returns a condition on the rowid column col, or "" for all rows.
+template <class Fn>
+bool for_each_digest_where(sqlite3* db, const TableSchema& schema, const std::string& table, Fn&& fn,
+    const std::function<std::string(const std::string&)>& range) {
+    unsigned char d[SHA256_DIGEST_LENGTH];
+    auto visit = [&](sqlite3_stmt* st, int i, long long rowid) {
+        int type = sqlite3_column_type(st, i);
+        if (type == SQLITE_BLOB && sqlite3_column_bytes(st, i) == SHA256_DIGEST_LENGTH) {
+            fn(rowid, static_cast<const unsigned char*>(sqlite3_column_blob(st, i)));
+        }
+        else if (type == SQLITE_TEXT) {
+            const char* txt = reinterpret_cast<const char*>(sqlite3_column_text(st, i));
+            if (parse_hex_digest(txt, static_cast<size_t>(sqlite3_column_bytes(st, i)), d)) fn(rowid, d);
+        }
+    };
+    if (!schema.shaCols.empty()) {
+        std::ostringstream q;
+        q << "SELECT rowid";
+        for (auto& c : schema.shaCols) q << ", \"" << c << '"';
+        q << " FROM '" << table << "'";
+        if (!range("rowid").empty()) q << " WHERE " << range("rowid");
+        sqlite3_stmt* st;
+        if (sqlite3_prepare_v2(db, q.str().c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+        int rc;
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+            long long rowid = sqlite3_column_int64(st, 0);
+            for (int i = 1; i <= static_cast<int>(schema.shaCols.size()); ++i) visit(st, i, rowid);
+        }
+        sqlite3_finalize(st);
+        if (rc != SQLITE_DONE) return false;
+    }
+    for (auto& e : schema.exprCols) {
+        std::string q = "SELECT rowid, " + e.expr + " FROM '" + table + "'";
+        if (!e.where.empty()) q += " WHERE (" + e.where + ")";
+        if (!range("rowid").empty()) q += (e.where.empty() ? " WHERE " : " AND ") + range("rowid");
+        sqlite3_stmt* st;
+        if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+        int rc;
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) visit(st, 1, sqlite3_column_int64(st, 0));
+        sqlite3_finalize(st);
+        if (rc != SQLITE_DONE) return false;
+    }
+    if (schema.packedHashes) {
+        std::string q = "SELECT rowid, row_hashes FROM '" + table + "' WHERE typeof(row_hashes) = 'blob'";
+        if (!range("rowid").empty()) q += " AND " + range("rowid");
+        sqlite3_stmt* st;
+        if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+        int rc;
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+            auto* p = static_cast<const unsigned char*>(sqlite3_column_blob(st, 1));
+            int n = sqlite3_column_bytes(st, 1);
+            for (int k = 0; k + SHA256_DIGEST_LENGTH <= n; k += SHA256_DIGEST_LENGTH) fn(sqlite3_column_int64(st, 0), p + k);
+        }
+        sqlite3_finalize(st);
+        if (rc != SQLITE_DONE) return false;
+    }
+    else if (schema.hasJson) {
+        std::string q = "SELECT t.rowid, je.value FROM '" + table + "' t, json_each(t.row_hashes) je";
+        if (!range("t.rowid").empty()) q += " WHERE " + range("t.rowid");
+        sqlite3_stmt* st;
+        if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+        int rc;
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) visit(st, 1, sqlite3_column_int64(st, 0));
+        sqlite3_finalize(st);
+        if (rc != SQLITE_DONE) return false;
+    }
+    if (!schema.digestTable.empty()) {
+        std::string q = "SELECT rid, digest FROM '" + schema.digestTable + "'";
+        if (!range("rid").empty()) q += " WHERE " + range("rid");
+        sqlite3_stmt* st;
+        if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+        int rc;
+        while ((rc = sqlite3_step(st)) == SQLITE_ROW) visit(st, 1, sqlite3_column_int64(st, 0));
+        sqlite3_finalize(st);
+        if (rc != SQLITE_DONE) return false;
+    }
+    return true;
+}
+
+// All digests, or those of rows in the rowid range lo..hi
+template <class Fn>
+bool for_each_digest(sqlite3* db, const TableSchema& schema, const std::string& table, Fn&& fn,
+    long long lo = LLONG_MIN, long long hi = LLONG_MAX) {
+    return for_each_digest_where(db, schema, table, fn, [&](const std::string& col) {
+        if (lo == LLONG_MIN && hi == LLONG_MAX) return std::string();
+        return col + " BETWEEN " + std::to_string(lo) + " AND " + std::to_string(hi);
+    });
+}
+
+// Digests of the given rows, a chunk of rowids per statement rather than
+// one statement per row, so catching up on N changes is not N table scans
+template <class Fn>
+bool for_each_digest_of(sqlite3* db, const TableSchema& schema, const std::string& table, const std::vector<long long>& rowids, Fn&& fn) {
+    const size_t kChunk = 8192;
+    for (size_t at = 0; at < rowids.size(); at += kChunk) {
+        std::string list;
+        for (size_t i = at; i < rowids.size() && i < at + kChunk; ++i) list += (i == at ? "" : ",") + std::to_string(rowids[i]);
+        bool ok = for_each_digest_where(db, schema, table, fn, [&](const std::string& col) {
+            return col + " IN (SELECT value FROM json_each('[" + list + "]'))";
+        });
+        if (!ok) return false;
+    }
+    return true;
+}
+
+// ---- Triggers and change log ----
+// install-triggers keeps digests current as rows are written: <col>_sha256
+// columns are recomputed with sha256_hex(), or, after reorganize, the
+// <table>_digests rows are replaced using sha256(). Every insert, update
+// and delete is also appended to lookup_changes, from which the prefix
+// index and the server's cuckoo index catch up without a full rescan.
+// Writers must register the SQL functions (see open_database).
+
+// Digest a source column the way backfill, ingest and the triggers store it
+std::string stored_digest_expr(const std::string& ref) {
+    return "CASE WHEN " + ref + " IS NULL OR " + ref + " = '' THEN NULL ELSE sha256_hex(" + ref + ") END";
+}
+
+// Highest change-log sequence number for the table: -1 without a change log
+long long change_log_position(sqlite3* db, const std::string& table) {
+    sqlite3_stmt* st;
+    if (sqlite3_prepare_v2(db, "SELECT coalesce(max(seq), 0) FROM lookup_changes WHERE tbl = ?", -1, &st, nullptr) != SQLITE_OK) return -1;
+    sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+    long long pos = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int64(st, 0) : -1;
+    sqlite3_finalize(st);
+    return pos;
+}
+
+// Rowids changed after sequence number since; upto receives the last one read
+bool changed_rowids(sqlite3* db, const std::string& table, long long since, std::vector<long long>& rowids, long long& upto) {
+    sqlite3_stmt* st;
+    if (sqlite3_prepare_v2(db, "SELECT seq, rid FROM lookup_changes WHERE tbl = ? AND seq > ? ORDER BY seq", -1, &st, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(st, 2, since);
+    upto = since;
+    int rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) {
+        upto = sqlite3_column_int64(st, 0);
+        rowids.push_back(sqlite3_column_int64(st, 1));
+    }
+    sqlite3_finalize(st);
+    std::sort(rowids.begin(), rowids.end());
+    rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+    return rc == SQLITE_DONE;
+}
+
+int install_triggers(sqlite3* db, const std::string& table, const std::vector<std::string>& hashCols) {
+    TableSchema schema = read_table_schema(db, table);
+    std::vector<std::string> all, cols;
+    sqlite3_stmt* st;
+    std::string sql = "PRAGMA table_info('" + table + "')";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    while (sqlite3_step(st) == SQLITE_ROW) all.push_back(reinterpret_cast<const char*>(sqlite3_column_text(st, 1)));
+    sqlite3_finalize(st);
+    if (all.empty()) { std::cerr << "No table " << table << "\n"; return 1; }
+    bool moved = !schema.digestTable.empty();
+    for (auto& c : all) {
+        bool wanted = !hashCols.empty() ? std::find(hashCols.begin(), hashCols.end(), c) != hashCols.end()
+            : moved ? !ends_with_ci(c, "_sha256") && !ends_with_ci(c, "_sha") && c != "row_hashes"
+            : std::find(all.begin(), all.end(), c + "_sha256") != all.end();
+        if (wanted) cols.push_back(c);
+    }
+    for (auto& h : hashCols)
+        if (std::find(all.begin(), all.end(), h) == all.end()) { std::cerr << "No column " << h << " in " << table << "\n"; return 1; }
+    if (cols.empty()) { std::cerr << "No hashed columns; pass --hash or run backfill first\n"; return 1; }
+
+    // Statements run for a row, written against NEW or OLD
+    auto refresh = [&](const std::string& row) {
+        std::string body;
+        if (!moved) {
+            std::string set;
+            for (auto& c : cols) set += (set.empty() ? "\"" : ", \"") + c + "_sha256\" = " + stored_digest_expr(row + ".\"" + c + '"');
+            body += "UPDATE \"" + table + "\" SET " + set + " WHERE rowid = " + row + ".rowid; ";
+        }
+        else {
+            for (auto& c : cols) {
+                std::string ref = row + ".\"" + c + '"';
+                body += "INSERT OR IGNORE INTO \"" + schema.digestTable + "\" (digest, rid) SELECT sha256(" + ref + "), " + row
+                    + ".rowid WHERE " + ref + " IS NOT NULL AND " + ref + " <> ''; ";
+            }
+        }
+        return body;
+    };
+    auto log = [&](const std::string& row, const char* op) {
+        return "INSERT INTO lookup_changes (tbl, rid, op) VALUES ('" + table + "', " + row + ".rowid, '" + op + "'); ";
+    };
+
+    std::string ofCols, newDigests;
+    for (auto& c : cols) {
+        ofCols += (ofCols.empty() ? "\"" : ", \"") + c + '"';
+        newDigests += (newDigests.empty() ? "" : ", ") + std::string("coalesce(sha256(NEW.\"") + c + "\"), x'')";
+    }
+    std::string onUpdate;
+    if (moved) {
+        // Drop the old digests no column of the new row still produces
+        for (auto& c : cols)
+            onUpdate += "DELETE FROM \"" + schema.digestTable + "\" WHERE rid = OLD.rowid AND digest = sha256(OLD.\"" + c
+                + "\") AND digest NOT IN (" + newDigests + "); ";
+    }
+    onUpdate += refresh("NEW") + log("NEW", "U")
+        + "INSERT INTO lookup_changes (tbl, rid, op) SELECT '" + table + "', OLD.rowid, 'D' WHERE OLD.rowid <> NEW.rowid; ";
+    std::string onDelete = (moved ? "DELETE FROM \"" + schema.digestTable + "\" WHERE rid = OLD.rowid; " : std::string()) + log("OLD", "D");
+
+    if (!exec_sql(db, "BEGIN IMMEDIATE")) return 1;
+    bool ok = true;
+    if (!moved)
+        for (auto& c : cols)
+            if (std::find(all.begin(), all.end(), c + "_sha256") == all.end())
+                ok = ok && exec_sql(db, "ALTER TABLE \"" + table + "\" ADD COLUMN \"" + c + "_sha256\" BLOB");
+    ok = ok && exec_sql(db, "CREATE TABLE IF NOT EXISTS lookup_changes (seq INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "tbl TEXT NOT NULL, rid INTEGER NOT NULL, op TEXT NOT NULL)");
+    for (const char* suffix : { "_lookup_ai", "_lookup_au", "_lookup_ad" })
+        ok = ok && exec_sql(db, "DROP TRIGGER IF EXISTS \"" + table + suffix + "\"");
+    ok = ok && exec_sql(db, "CREATE TRIGGER \"" + table + "_lookup_ai\" AFTER INSERT ON \"" + table + "\" BEGIN "
+        + refresh("NEW") + log("NEW", "I") + "END");
+    ok = ok && exec_sql(db, "CREATE TRIGGER \"" + table + "_lookup_au\" AFTER UPDATE OF " + ofCols + " ON \"" + table + "\" BEGIN "
+        + onUpdate + "END");
+    ok = ok && exec_sql(db, "CREATE TRIGGER \"" + table + "_lookup_ad\" AFTER DELETE ON \"" + table + "\" BEGIN "
+        + onDelete + "END");
+    if (!ok || !exec_sql(db, "COMMIT")) { exec_sql(db, "ROLLBACK"); return 1; }
+    std::cout << "Installed triggers on " << table << " for " << cols.size() << " columns"
+        << (moved ? " into " + schema.digestTable : std::string()) << "\n";
+    if (!moved) std::cout << "Existing rows are not rehashed; run backfill --verify once if they may be stale\n";
+    return 0;
+}
+
+// ---- Minimal perfect hash index ----
+// <db>.<table>.mphf maps every distinct digest of a table to one slot
+// holding a 32-bit fingerprint and the list of rowids carrying that digest.
+// The hash function is BBHash: a cascade of bit arrays (gamma = 2), each
+// key settling in the first level where it does not collide; the slot is
+// the rank of its bit. Keys that never settle go to a small sorted list.
+// Costs ~3.7 bits per key plus the payload; a lookup touches one or two
+// bit-array words, one fingerprint and the rowid list.
+
+const int kMphfMaxLevels = 24;
+
+struct MphfHeader {
+    char magic[8];          // "LKMPHF1"
+    uint64_t keys;          // distinct digests, i.e. slots
+    uint64_t rowids;        // total rowid entries
+    uint64_t fallback;      // keys stored in the sorted list
+    uint64_t totalBits;     // bits of all levels, multiple of 512
+    uint32_t levels;
+    uint32_t reserved;
+    uint64_t levelBits[kMphfMaxLevels];
+    int64_t stampSize;      // database stamp at build time
+    int64_t stampMtime;
+    int64_t stampWalSize;
+    int64_t stampWalMtime;
+    uint64_t stampCounter;
+};
+
+inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+inline uint64_t mphf_hash(const unsigned char* d, uint32_t level) {
+    uint64_t a, b;
+    std::memcpy(&a, d, 8);
+    std::memcpy(&b, d + 8, 8);
+    return mix64(a ^ mix64(b + 0x9e3779b97f4a7c15ULL * (level + 1)));
+}
+
+inline uint32_t mphf_fingerprint(const unsigned char* d) {
+    uint32_t f;
+    std::memcpy(&f, d + 16, 4);
+    return f;
+}
+
+inline size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+
+std::string mphf_path(const std::string& dbFile, const std::string& table) { return dbFile + "." + table + ".mphf"; }
+
+// Memory-mapped view of a .mphf file
+class MphfIndex {
+public:
+    bool open(const std::string& path, const FileStamp& stamp) {
+        if (!file_.open(path) || file_.size() < sizeof(MphfHeader)) return false;
+        std::memcpy(&h_, file_.data(), sizeof(h_));
+        if (std::memcmp(h_.magic, "LKMPHF1", 8) != 0 || h_.levels > kMphfMaxLevels) return false;
+        stale_ = h_.stampSize != stamp.size || h_.stampMtime != stamp.mtime || h_.stampCounter != stamp.changeCounter ||
+            h_.stampWalSize != stamp.walSize || h_.stampWalMtime != stamp.walMtime;
+        if (stale_) return false;
+        // A truncated or corrupt file must fail here, not in slot(): every
+        // level is a nonzero multiple of 512 bits, they add up to totalBits,
+        // and each section fits in what is left of the mapping
+        uint64_t size = file_.size(), bits = 0;
+        for (uint32_t l = 0; l < h_.levels; ++l) {
+            if (h_.levelBits[l] == 0 || h_.levelBits[l] % 512 != 0 || h_.levelBits[l] > size * 8) return false;
+            bits += h_.levelBits[l];
+        }
+        if (bits != h_.totalBits || h_.fallback > h_.keys) return false;
+        uint64_t off = align8(sizeof(MphfHeader));
+        auto section = [&](uint64_t count, uint64_t width) {
+            if (count > (size - std::min(off, size)) / width) return false;
+            off += count * width;
+            return true;
+        };
+        words_ = reinterpret_cast<const uint64_t*>(file_.data() + off);
+        if (!section(h_.totalBits / 64, 8)) return false;
+        ranks_ = reinterpret_cast<const uint64_t*>(file_.data() + off);
+        if (!section(h_.totalBits / 512 + 1, 8)) return false;
+        fallback_ = file_.data() + off;
+        if (!section(h_.fallback, SHA256_DIGEST_LENGTH)) return false;
+        fps_ = reinterpret_cast<const uint32_t*>(file_.data() + off);
+        if (!section(h_.keys, 4)) return false;
+        off = align8(off);
+        offsets_ = reinterpret_cast<const uint64_t*>(file_.data() + off);
+        if (!section(h_.keys + 1, 8)) return false;
+        rowids_ = reinterpret_cast<const int64_t*>(file_.data() + off);
+        return section(h_.rowids, 8);
+    }
+
+    // Slot of a digest, or -1 when it certainly is not in the table
+    int64_t slot(const unsigned char* d) const {
+        uint64_t base = 0;
+        for (uint32_t l = 0; l < h_.levels; ++l) {
+            uint64_t pos = base + mphf_hash(d, l) % h_.levelBits[l];
+            if (words_[pos >> 6] >> (pos & 63) & 1) return static_cast<int64_t>(rank(pos));
+            base += h_.levelBits[l];
+        }
+        size_t lo = 0, hi = static_cast<size_t>(h_.fallback);
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            int c = std::memcmp(fallback_ + mid * SHA256_DIGEST_LENGTH, d, SHA256_DIGEST_LENGTH);
+            if (c == 0) return static_cast<int64_t>(h_.keys - h_.fallback + mid);
+            if (c < 0) lo = mid + 1; else hi = mid;
+        }
+        return -1;
+    }
+
+    // Candidate rowids for a digest; a fingerprint match still needs verifying
+    void find(const unsigned char* d, std::vector<long long>& out) const {
+        int64_t s = slot(d);
+        if (s < 0 || static_cast<uint64_t>(s) >= h_.keys || fps_[s] != mphf_fingerprint(d)) return;
+        uint64_t end = std::min<uint64_t>(offsets_[s + 1], h_.rowids);
+        for (uint64_t i = offsets_[s]; i < end; ++i) out.push_back(rowids_[i]);
+    }
+
+    // True when open() found the file but it was built for another state of the database
+    bool stale() const { return stale_; }
+
+private:
+    uint64_t rank(uint64_t pos) const {
+        uint64_t r = ranks_[pos >> 9];
+        for (uint64_t w = (pos >> 9) << 3; w < (pos >> 6); ++w) r += popcount64(words_[w]);
+        return r + popcount64(words_[pos >> 6] & ((uint64_t(1) << (pos & 63)) - 1));
+    }
+
+    MappedFile file_;
+    bool stale_ = false;
+    MphfHeader h_{};
+    const uint64_t* words_ = nullptr;
+    const uint64_t* ranks_ = nullptr;
+    const unsigned char* fallback_ = nullptr;
+    const uint32_t* fps_ = nullptr;
+    const uint64_t* offsets_ = nullptr;
+    const int64_t* rowids_ = nullptr;
+};
+
+// Build <db>.<table>.mphf from all digests currently in the table
+int build_mphf_index(sqlite3* db, const std::string& dbFile, const std::string& table, const TableSchema& schema) {
+    struct Entry { unsigned char d[SHA256_DIGEST_LENGTH]; long long rowid; };
+    FileStamp stamp = read_file_stamp(dbFile);
+    std::vector<Entry> entries;
+    bool ok = for_each_digest(db, schema, table, [&](long long rowid, const unsigned char* d) {
+        Entry e;
+        std::memcpy(e.d, d, SHA256_DIGEST_LENGTH);
+        e.rowid = rowid;
+        entries.push_back(e);
+    });
+    if (!ok) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        int c = std::memcmp(a.d, b.d, SHA256_DIGEST_LENGTH);
+        return c < 0 || (c == 0 && a.rowid < b.rowid);
+    });
+    entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.rowid == b.rowid && std::memcmp(a.d, b.d, SHA256_DIGEST_LENGTH) == 0;
+    }), entries.end());
+
+    // One key per distinct digest, pointing at its first entry
+    std::vector<size_t> keys;
+    for (size_t i = 0; i < entries.size(); ++i)
+        if (i == 0 || std::memcmp(entries[i].d, entries[i - 1].d, SHA256_DIGEST_LENGTH) != 0) keys.push_back(i);
+
+    MphfHeader h{};
+    std::memcpy(h.magic, "LKMPHF1", 8);
+    h.keys = keys.size();
+    h.rowids = entries.size();
+    h.stampSize = stamp.size;
+    h.stampMtime = stamp.mtime;
+    h.stampWalSize = stamp.walSize;
+    h.stampWalMtime = stamp.walMtime;
+    h.stampCounter = stamp.changeCounter;
+
+    std::vector<uint64_t> words;
+    std::vector<size_t> remaining = keys;
+    while (!remaining.empty() && h.levels < kMphfMaxLevels) {
+        uint64_t m = std::max<uint64_t>(512, (remaining.size() * 2 + 511) / 512 * 512);
+        std::vector<uint64_t> bits(m / 64), coll(m / 64);
+        for (size_t k : remaining) {
+            uint64_t p = mphf_hash(entries[k].d, h.levels) % m;
+            if (bits[p >> 6] >> (p & 63) & 1) coll[p >> 6] |= uint64_t(1) << (p & 63);
+            else bits[p >> 6] |= uint64_t(1) << (p & 63);
+        }
+        std::vector<size_t> next;
+        for (size_t k : remaining) {
+            uint64_t p = mphf_hash(entries[k].d, h.levels) % m;
+            if (coll[p >> 6] >> (p & 63) & 1) next.push_back(k);
+        }
+        for (size_t w = 0; w < bits.size(); ++w) bits[w] &= ~coll[w];
+        words.insert(words.end(), bits.begin(), bits.end());
+        h.levelBits[h.levels++] = m;
+        remaining.swap(next);
+    }
+    h.totalBits = words.size() * 64;
+    h.fallback = remaining.size();
+
+    std::vector<uint64_t> ranks(words.size() / 8 + 1);
+    uint64_t acc = 0;
+    for (size_t w = 0; w < words.size(); ++w) {
+        if (w % 8 == 0) ranks[w / 8] = acc;
+        acc += popcount64(words[w]);
+    }
+    ranks.back() = acc;
+
+    // Place each key's fingerprint and rowid list at its slot
+    auto slot_of = [&](const unsigned char* d) -> int64_t {
+        uint64_t base = 0;
+        for (uint32_t l = 0; l < h.levels; ++l) {
+            uint64_t pos = base + mphf_hash(d, l) % h.levelBits[l];
+            if (words[pos >> 6] >> (pos & 63) & 1) {
+                uint64_t r = ranks[pos >> 9];
+                for (uint64_t w = (pos >> 9) << 3; w < (pos >> 6); ++w) r += popcount64(words[w]);
+                return static_cast<int64_t>(r + popcount64(words[pos >> 6] & ((uint64_t(1) << (pos & 63)) - 1)));
+            }
+            base += h.levelBits[l];
+        }
+        return -1;
+    };
+    std::vector<uint32_t> fps(keys.size());
+    std::vector<uint64_t> offsets(keys.size() + 1, 0);
+    std::vector<int64_t> rowids(entries.size());
+    std::vector<int64_t> slotOf(keys.size());
+    size_t fb = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int64_t s = slot_of(entries[keys[i]].d);
+        if (s < 0) s = static_cast<int64_t>(h.keys - h.fallback + fb++);
+        size_t end = i + 1 < keys.size() ? keys[i + 1] : entries.size();
+        slotOf[i] = s;
+        fps[s] = mphf_fingerprint(entries[keys[i]].d);
+        offsets[s + 1] = end - keys[i];
+    }
+    for (size_t s = 0; s < keys.size(); ++s) offsets[s + 1] += offsets[s];
+    for (size_t i = 0; i < keys.size(); ++i) {
+        size_t end = i + 1 < keys.size() ? keys[i + 1] : entries.size();
+        uint64_t o = offsets[slotOf[i]];
+        for (size_t e = keys[i]; e < end; ++e) rowids[o++] = entries[e].rowid;
+    }
+
+    std::string path = mphf_path(dbFile, table), tmp = path + ".tmp";
+    {
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        if (!out) { std::cerr << "Cannot open " << tmp << "\n"; return 1; }
+        auto write = [&](const void* p, size_t n) { out.write(static_cast<const char*>(p), static_cast<std::streamsize>(n)); };
+        auto pad = [&]() { static const char z[8] = {}; write(z, align8(static_cast<size_t>(out.tellp())) - static_cast<size_t>(out.tellp())); };
+        write(&h, sizeof(h));
+        pad();
+        write(words.data(), words.size() * 8);
+        write(ranks.data(), ranks.size() * 8);
+        for (size_t k : remaining) write(entries[k].d, SHA256_DIGEST_LENGTH);
+        write(fps.data(), fps.size() * 4);
+        pad();
+        write(offsets.data(), offsets.size() * 8);
+        write(rowids.data(), rowids.size() * 8);
+        out.close();
+        if (!out) { std::cerr << "Cannot write " << tmp << "\n"; return 1; }
+    }
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+    if (ec) { std::cerr << "Cannot replace " << path << "\n"; return 1; }
+    std::cout << "Indexed " << h.keys << " digests (" << h.rowids << " rowids) into " << path << ", "
+        << std::fixed << std::setprecision(2) << (h.keys ? (h.totalBits + 256.0 * h.fallback) / h.keys : 0.0)
+        << " bits/key for the hash function\n";
+    return 0;
+}
+
+// ---- External sort ----
+// Produces a table's (digest, rowid) pairs in key order when they do not
+// fit in memory. Worker threads scan disjoint rowid ranges on their own
+// read-only connections, sort a bounded buffer and spill it as a run file
+// whenever it fills; a k-way merge then streams all runs in order. Buffers
+// that never filled are merged straight from memory.
+
+struct BuildOptions {
+    size_t memoryBytes = size_t(1) << 30;   // sort buffers, split across workers
+    unsigned threads = 0;                   // extraction workers; 0 picks from the core count
+    std::string tmpDir;                     // run files; defaults to the database's directory
+    bool full = false;                      // rebuild even if the change log allows an update
+};
+
+// Full digest and rowid, ordered like the <table>_digests primary key
+struct DigestRow {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    int64_t rowid;
+};
+
+inline bool operator<(const DigestRow& a, const DigestRow& b) {
+    int c = std::memcmp(a.digest, b.digest, SHA256_DIGEST_LENGTH);
+    return c < 0 || (c == 0 && a.rowid < b.rowid);
+}
+
+inline bool operator==(const DigestRow& a, const DigestRow& b) {
+    return a.rowid == b.rowid && std::memcmp(a.digest, b.digest, SHA256_DIGEST_LENGTH) == 0;
+}
+
+// Sorted runs of trivially copyable entries, on disk or in memory
+template <class T>
+class SortedRuns {
+public:
+    explicit SortedRuns(std::string dir) : dir_(std::move(dir)) {}
+
+    ~SortedRuns() {
+        std::error_code ec;
+        for (auto& f : files_) std::filesystem::remove(std::filesystem::u8path(f), ec);
+    }
+
+    // Sort a full buffer and write it out as a run; safe to call from any worker
+    bool spill(std::vector<T>& buf) {
+        std::sort(buf.begin(), buf.end());
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            path = (std::filesystem::u8path(dir_) / ("lookup-run-" + std::to_string(reinterpret_cast<uintptr_t>(this))
+                + "-" + std::to_string(files_.size()) + ".tmp")).u8string();
+            files_.push_back(path);
+            total_ += buf.size();
+            ++spilled_;
+        }
+        std::ofstream out(std::filesystem::u8path(path), std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(buf.size() * sizeof(T)));
+        buf.clear();
+        return static_cast<bool>(out);
+    }
+
+    // Keep a worker's last, partly filled buffer as an in-memory run
+    void keep(std::vector<T>&& buf) {
+        std::sort(buf.begin(), buf.end());
+        std::lock_guard<std::mutex> lock(m_);
+        total_ += buf.size();
+        memory_.push_back(std::move(buf));
+    }
+
+    size_t spilled() const { return spilled_; }
+    uint64_t total() const { return total_; }
+
+    // Visit every entry in order; false if a run file cannot be read
+    template <class Fn>
+    bool merge(Fn&& fn) {
+        struct Source {
+            std::vector<T> buf;
+            size_t pos = 0;
+            std::unique_ptr<std::ifstream> file;
+        };
+        const size_t kRead = (size_t(1) << 20) / sizeof(T) + 1;
+        std::vector<Source> src(files_.size() + memory_.size());
+        auto refill = [&](Source& s) {
+            if (!s.file) return false;
+            s.buf.resize(kRead);
+            s.file->read(reinterpret_cast<char*>(s.buf.data()), static_cast<std::streamsize>(kRead * sizeof(T)));
+            s.buf.resize(static_cast<size_t>(s.file->gcount()) / sizeof(T));
+            s.pos = 0;
+            return !s.buf.empty();
+        };
+        for (size_t i = 0; i < files_.size(); ++i) {
+            src[i].file.reset(new std::ifstream(std::filesystem::u8path(files_[i]), std::ios::binary));
+            if (!*src[i].file) return false;
+            refill(src[i]);
+        }
+        for (size_t i = 0; i < memory_.size(); ++i) src[files_.size() + i].buf.swap(memory_[i]);
+
+        // Min-heap of source indexes keyed by their current entry
+        auto after = [&](size_t a, size_t b) { return src[b].buf[src[b].pos] < src[a].buf[src[a].pos]; };
+        std::vector<size_t> heap;
+        for (size_t i = 0; i < src.size(); ++i)
+            if (!src[i].buf.empty()) heap.push_back(i);
+        std::make_heap(heap.begin(), heap.end(), after);
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), after);
+            Source& s = src[heap.back()];
+            fn(s.buf[s.pos]);
+            if (++s.pos < s.buf.size() || refill(s)) std::push_heap(heap.begin(), heap.end(), after);
+            else heap.pop_back();
+        }
+        return true;
+    }
+
+private:
+    std::string dir_;
+    std::mutex m_;
+    std::vector<std::string> files_;
+    std::vector<std::vector<T>> memory_;
+    std::atomic<size_t> spilled_{ 0 };
+    uint64_t total_ = 0;
+};
+
+// Fill runs with make(rowid, digest) for every digest of the table, scanning
+// rowid ranges in parallel. Reports progress on stderr.
+template <class T, class Make>
+bool extract_sorted(sqlite3* db, const TableSchema& schema, const std::string& table, const BuildOptions& opts, SortedRuns<T>& runs, Make&& make) {
+    const char* file = sqlite3_db_filename(db, "main");
+    std::string path = file ? file : "";
+    unsigned cores = std::thread::hardware_concurrency();
+    unsigned workers = opts.threads ? opts.threads : cores ? cores : 1;
+    if (path.empty()) workers = 1;   // in-memory database: only this connection sees it
+    size_t perWorker = std::max<size_t>(opts.memoryBytes / workers / sizeof(T), 1024);
+
+    long long lo = 0, hi = -1;
+    sqlite3_stmt* st;
+    std::string q = "SELECT min(rowid), max(rowid) FROM '" + table + "'";
+    if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) return false;
+    if (sqlite3_step(st) == SQLITE_ROW && sqlite3_column_type(st, 0) != SQLITE_NULL) {
+        lo = sqlite3_column_int64(st, 0);
+        hi = sqlite3_column_int64(st, 1);
+    }
+    sqlite3_finalize(st);
+    if (hi < lo) return true;
+    unsigned long long span = static_cast<unsigned long long>(hi - lo) / workers + 1;
+
+    std::atomic<uint64_t> extracted{ 0 };
+    std::atomic<unsigned> running{ workers };
+    std::atomic<bool> ok{ true };
+    auto work = [&](unsigned w) {
+        trace_thread_name("extract worker " + std::to_string(w));
+        sqlite3* conn = db;
+        if (workers > 1 && !open_database(path, SQLITE_OPEN_READONLY, &conn)) { ok = false; --running; return; }
+        long long a = lo + static_cast<long long>(span * w);
+        long long b = w + 1 == workers ? hi : a + static_cast<long long>(span) - 1;
+        TraceSpan trace("extract", "rowids " + std::to_string(a) + ".." + std::to_string(b));
+        std::vector<T> buf;
+        buf.reserve(perWorker);
+        uint64_t n = 0;
+        bool good = a > hi || for_each_digest(conn, schema, table, [&](long long rowid, const unsigned char* d) {
+            buf.push_back(make(rowid, d));
+            if (buf.size() == perWorker && !runs.spill(buf)) ok = false;
+            if ((++n & 4095) == 0) extracted += 4096;
+        }, a, b);
+        if (!good) std::cerr << sqlite3_errmsg(conn) << "\n";
+        if (!good) ok = false;
+        runs.keep(std::move(buf));
+        if (conn != db) sqlite3_close(conn);
+        --running;
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    if (workers == 1) work(0);
+    else {
+        std::vector<std::thread> threads;
+        for (unsigned w = 0; w < workers; ++w) threads.emplace_back(work, w);
+        while (running > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::cerr << "\rExtracting: " << extracted << " digests, " << static_cast<uint64_t>(extracted / std::max(secs, 0.001))
+                << "/s, " << runs.spilled() << " runs spilled" << std::flush;
+        }
+        for (auto& t : threads) t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cerr << "\rExtracted " << runs.total() << " digests in " << std::fixed << std::setprecision(1) << secs << " s with "
+        << workers << " workers, " << runs.spilled() << " runs spilled\n";
+    return ok;
+}
+
+// Report merge progress about once a second
+class MergeProgress {
+public:
+    explicit MergeProgress(uint64_t total) : total_(total), t0_(std::chrono::steady_clock::now()), last_(t0_) {}
+
+    void step() {
+        if ((++done_ & 0xFFFF) != 0) return;
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_ < std::chrono::seconds(1)) return;
+        last_ = now;
+        double secs = std::chrono::duration<double>(now - t0_).count();
+        std::cerr << "\rMerging: " << done_ << " of " << total_ << ", " << static_cast<uint64_t>(done_ / secs) << "/s" << std::flush;
+    }
+
+    void finish() {
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0_).count();
+        std::cerr << "\rMerged " << done_ << " entries in " << std::fixed << std::setprecision(1) << secs << " s\n";
+    }
+
+private:
+    uint64_t total_, done_ = 0;
+    std::chrono::steady_clock::time_point t0_, last_;
+};
+
+std::string run_directory(const std::string& dbFile, const BuildOptions& opts) {
+    if (!opts.tmpDir.empty()) return opts.tmpDir;
+    auto dir = std::filesystem::u8path(dbFile).parent_path();
+    return dir.empty() ? "." : dir.u8string();
+}
+
+// ---- Sorted prefix index ----
+// <db>.<table>.pfx keeps only the first 8 bytes of every digest, packed
+// with its rowid into a 16-byte entry and sorted, so the whole index of a
+// 1B-row table is 16 GB instead of the 80+ bytes per row a B-tree on hex
+// text costs. Digests are uniform, so a lookup interpolates straight to
+// the right page. Prefix matches are candidates and verified in SQLite.
+
+struct PrefixHeader {
+    char magic[8];          // "LKPFX1"
+    uint64_t count;
+    int64_t stampSize;      // database stamp at build time
+    int64_t stampMtime;
+    int64_t stampWalSize;
+    int64_t stampWalMtime;
+    uint64_t stampCounter;
+    uint64_t logSeq;        // lookup_changes position at build time + 1; 0 without a change log
+};
+
+struct PrefixEntry {
+    uint64_t prefix;        // first 8 digest bytes, big-endian, so entries sort like digests
+    int64_t rowid;
+};
+
+inline uint64_t digest_prefix(const unsigned char* d) {
+    uint64_t p = 0;
+    for (int i = 0; i < 8; ++i) p = p << 8 | d[i];
+    return p;
+}
+
+inline bool operator<(const PrefixEntry& a, const PrefixEntry& b) {
+    return a.prefix < b.prefix || (a.prefix == b.prefix && a.rowid < b.rowid);
+}
+
+std::string prefix_index_path(const std::string& dbFile, const std::string& table) { return dbFile + "." + table + ".pfx"; }
+
+PrefixHeader make_prefix_header(const FileStamp& stamp, uint64_t count) {
+    PrefixHeader h{};
+    std::memcpy(h.magic, "LKPFX1", 7);
+    h.count = count;
+    h.stampSize = stamp.size;
+    h.stampMtime = stamp.mtime;
+    h.stampWalSize = stamp.walSize;
+    h.stampWalMtime = stamp.walMtime;
+    h.stampCounter = stamp.changeCounter;
+    return h;
+}
+
+// Memory-mapped view of a .pfx file
+class PrefixIndex {
+public:
+    bool open(const std::string& path, const FileStamp& stamp) {
+        if (!file_.open(path) || file_.size() < sizeof(PrefixHeader)) return false;
+        PrefixHeader h;
+        std::memcpy(&h, file_.data(), sizeof(h));
+        if (std::memcmp(h.magic, "LKPFX1", 7) != 0 || file_.size() < sizeof(h) + h.count * sizeof(PrefixEntry)) return false;
+        stale_ = h.stampSize != stamp.size || h.stampMtime != stamp.mtime || h.stampCounter != stamp.changeCounter ||
+            h.stampWalSize != stamp.walSize || h.stampWalMtime != stamp.walMtime;
+        if (stale_) return false;
+        entries_ = reinterpret_cast<const PrefixEntry*>(file_.data() + sizeof(h));
+        count_ = static_cast<size_t>(h.count);
+        return true;
+    }
+
+    // Append the rowids of every entry sharing the digest's prefix
+    void find(const unsigned char* d, std::vector<long long>& out) const {
+        uint64_t key = digest_prefix(d);
+        size_t lo = 0, hi = count_;
+        // A few interpolation steps, then binary search in what is left
+        for (int step = 0; step < 3 && hi - lo > 64; ++step) {
+            uint64_t a = entries_[lo].prefix, b = entries_[hi - 1].prefix;
+            if (key <= a) { hi = lo + 1; break; }
+            if (key > b) return;
+            size_t guess = lo + static_cast<size_t>(static_cast<long double>(key - a) / (b - a) * (hi - 1 - lo));
+            size_t slack = (hi - lo) / 64 + 8;
+            size_t g0 = guess > lo + slack ? guess - slack : lo, g1 = std::min(hi, guess + slack);
+            if (entries_[g0].prefix >= key) hi = g0 + 1;
+            else if (g1 < hi && entries_[g1].prefix < key) lo = g1;
+            else { lo = g0; hi = std::min(hi, g1 + 1); }
+        }
+        const PrefixEntry* it = std::lower_bound(entries_ + lo, entries_ + hi, key,
+            [](const PrefixEntry& e, uint64_t k) { return e.prefix < k; });
+        for (; it < entries_ + count_ && it->prefix == key; ++it) out.push_back(it->rowid);
+    }
+
+    size_t size() const { return count_; }
+    bool stale() const { return stale_; }
+
+private:
+    MappedFile file_;
+    bool stale_ = false;
+    const PrefixEntry* entries_ = nullptr;
+    size_t count_ = 0;
+};
+
+// Bring an existing .pfx file up to date from the change log: entries of
+// changed rows are dropped, their current digests re-read and merged in.
+// Returns -1 when the file cannot be updated and a full build is needed.
+int update_prefix_index(sqlite3* db, const std::string& dbFile, const std::string& table, const TableSchema& schema) {
+    std::string path = prefix_index_path(dbFile, table), tmp = path + ".tmp";
+    // Stamp first: a commit after this point leaves the new file stale, never wrong
+    FileStamp stamp = read_file_stamp(dbFile);
+    MappedFile old;
+    if (!old.open(path) || old.size() < sizeof(PrefixHeader)) return -1;
+    PrefixHeader h;
+    std::memcpy(&h, old.data(), sizeof(h));
+    if (std::memcmp(h.magic, "LKPFX1", 7) != 0 || h.logSeq == 0 || old.size() < sizeof(h) + h.count * sizeof(PrefixEntry)) return -1;
+    std::vector<long long> rowids;
+    long long upto;
+    if (!changed_rowids(db, table, static_cast<long long>(h.logSeq) - 1, rowids, upto)) return -1;
+    if (rowids.size() > h.count / 4 + 4096) return -1;   // cheaper to rebuild
+
+    std::vector<PrefixEntry> fresh;
+    bool ok = for_each_digest_of(db, schema, table, rowids, [&](long long rowid, const unsigned char* d) {
+        fresh.push_back({ digest_prefix(d), rowid });
+    });
+    if (!ok) return -1;
+    std::sort(fresh.begin(), fresh.end());
+
+    const PrefixEntry* entries = reinterpret_cast<const PrefixEntry*>(old.data() + sizeof(h));
+    uint64_t count = 0;
+    {
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        if (!out) { std::cerr << "Cannot open " << tmp << "\n"; return 1; }
+        PrefixHeader nh = make_prefix_header(stamp, 0);
+        out.write(reinterpret_cast<const char*>(&nh), sizeof(nh));
+        PrefixEntry last{ 0, 0 };
+        auto emit = [&](const PrefixEntry& e) {
+            if (count && e.prefix == last.prefix && e.rowid == last.rowid) return;
+            last = e;
+            ++count;
+            out.write(reinterpret_cast<const char*>(&e), sizeof(e));
+        };
+        size_t i = 0, j = 0;
+        while (i < h.count || j < fresh.size()) {
+            if (i < h.count && std::binary_search(rowids.begin(), rowids.end(), entries[i].rowid)) { ++i; continue; }
+            if (j == fresh.size() || (i < h.count && entries[i] < fresh[j])) emit(entries[i++]);
+            else emit(fresh[j++]);
+        }
+        nh = make_prefix_header(stamp, count);
+        nh.logSeq = static_cast<uint64_t>(upto) + 1;
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&nh), sizeof(nh));
+        out.close();
+        if (!out) { std::cerr << "Cannot write " << tmp << "\n"; return 1; }
+    }
+    old.close();
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+    if (ec) { std::cerr << "Cannot replace " << path << "\n"; return 1; }
+    std::cout << "Updated " << path << " from " << rowids.size() << " changed rows: " << count << " digest prefixes\n";
+    return 0;
+}
+
+// Build <db>.<table>.pfx from all digests currently in the table, or update
+// it from the change log when possible. Entries are sorted externally, so
+// the table may be far larger than RAM.
+int build_prefix_index(sqlite3* db, const std::string& dbFile, const std::string& table, const TableSchema& schema, const BuildOptions& opts = {}) {
+    long long logPos = change_log_position(db, table);
+    if (logPos >= 0 && !opts.full) {
+        int rc = update_prefix_index(db, dbFile, table, schema);
+        if (rc >= 0) return rc;
+    }
+    FileStamp stamp = read_file_stamp(dbFile);
+    logPos = change_log_position(db, table);
+    SortedRuns<PrefixEntry> runs(run_directory(dbFile, opts));
+    bool ok = extract_sorted(db, schema, table, opts, runs, [](long long rowid, const unsigned char* d) {
+        return PrefixEntry{ digest_prefix(d), rowid };
+    });
+    if (!ok) return 1;
+
+    std::string path = prefix_index_path(dbFile, table), tmp = path + ".tmp";
+    uint64_t count = 0;
+    {
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        if (!out) { std::cerr << "Cannot open " << tmp << "\n"; return 1; }
+        PrefixHeader h = make_prefix_header(stamp, 0);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        std::vector<PrefixEntry> block;
+        block.reserve(1 << 16);
+        PrefixEntry last{ 0, 0 };
+        MergeProgress progress(runs.total());
+        ok = runs.merge([&](const PrefixEntry& e) {
+            progress.step();
+            if (count && e.prefix == last.prefix && e.rowid == last.rowid) return;
+            last = e;
+            ++count;
+            block.push_back(e);
+            if (block.size() == block.capacity()) {
+                out.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(block.size() * sizeof(PrefixEntry)));
+                block.clear();
+            }
+        });
+        progress.finish();
+        out.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(block.size() * sizeof(PrefixEntry)));
+        // The count is only known after the merge removed duplicates
+        h = make_prefix_header(stamp, count);
+        h.logSeq = logPos >= 0 ? static_cast<uint64_t>(logPos) + 1 : 0;
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.close();
+        if (!ok || !out) { std::cerr << "Cannot write " << tmp << "\n"; return 1; }
+    }
+    std::error_code ec;
+    std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+    if (ec) { std::cerr << "Cannot replace " << path << "\n"; return 1; }
+    std::cout << "Indexed " << count << " digest prefixes into " << path << " ("
+        << (sizeof(PrefixHeader) + count * sizeof(PrefixEntry)) / 1024 << " KiB)\n";
+    return 0;
+}
+
+// ---- Concurrent cuckoo index ----
+// In-memory map from the first 8 bytes of a digest to a rowid, for the
+// server. Buckets hold 4 slots; each key has two candidate buckets. One
+// writer thread inserts (displacing along a BFS path, copying before
+// clearing so a key is never absent), readers never lock: they validate
+// against per-stripe sequence counters and retry on a concurrent write.
+// A digest carried by several rows stores kCuckooMulti and is resolved in
+// SQL. Every hit is a candidate only and must be verified against SQLite.
+
+const int64_t kCuckooMulti = INT64_MIN;
+
+class DigestCuckoo {
+public:
+    enum class Probe { Absent, Hit, Multi };
+
+    DigestCuckoo() : stripes_(new Stripe[kStripes]) { publish(new Table(1 << 14)); }
+    DigestCuckoo(const DigestCuckoo&) = delete;
+    DigestCuckoo& operator=(const DigestCuckoo&) = delete;
+
+    static uint64_t key_of(const unsigned char* d) {
+        uint64_t k;
+        std::memcpy(&k, d, 8);
+        return k ? k : 1;   // 0 marks an empty slot
+    }
+
+    // Lock-free read; safe against the single concurrent writer
+    Probe find(uint64_t key, long long& rowid) const {
+        for (;;) {
+            const Table* t = table_.load(std::memory_order_acquire);
+            size_t b1 = bucket1(key, t->mask), b2 = bucket2(key, t->mask);
+            uint64_t v1 = stripe(b1).load(std::memory_order_acquire);
+            uint64_t v2 = stripe(b2).load(std::memory_order_acquire);
+            if ((v1 | v2) & 1) { std::this_thread::yield(); continue; }
+            int64_t found = 0;
+            bool hit = false;
+            for (size_t b : { b1, b2 }) {
+                for (auto& s : t->buckets[b].slots) {
+                    if (s.key.load(std::memory_order_relaxed) == key) {
+                        found = s.val.load(std::memory_order_relaxed);
+                        hit = true;
+                    }
+                }
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (stripe(b1).load(std::memory_order_relaxed) != v1 || stripe(b2).load(std::memory_order_relaxed) != v2 ||
+                table_.load(std::memory_order_relaxed) != t)
+                continue;
+            if (!hit) return Probe::Absent;
+            if (found == kCuckooMulti) return Probe::Multi;
+            rowid = found;
+            return Probe::Hit;
+        }
+    }
+
+    // Writer side: only one thread may call insert()
+    void insert(uint64_t key, long long rowid) {
+        Table* t = table_.load(std::memory_order_relaxed);
+        size_t b;
+        if (Slot* s = locate(t, key, b)) {
+            int64_t cur = s->val.load(std::memory_order_relaxed);
+            if (cur != rowid && cur != kCuckooMulti) {
+                begin_write(b);
+                s->val.store(kCuckooMulti, std::memory_order_relaxed);
+                end_write(b);
+            }
+            return;
+        }
+        while (!place(t, key, rowid)) t = grow(t);
+        ++size_;
+    }
+
+    size_t size() const { return size_; }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> key{ 0 };
+        std::atomic<int64_t> val{ 0 };
+    };
+    struct Bucket { Slot slots[4]; };
+    struct Table {
+        explicit Table(size_t n) : mask(n - 1), buckets(new Bucket[n]) {}
+        size_t mask;
+        std::unique_ptr<Bucket[]> buckets;
+    };
+    struct alignas(64) Stripe { std::atomic<uint64_t> seq{ 0 }; };
+    static const size_t kStripes = 1024;
+    static const int kMaxPath = 5;
+
+    static size_t bucket1(uint64_t key, size_t mask) { return static_cast<size_t>(mix64(key)) & mask; }
+    static size_t bucket2(uint64_t key, size_t mask) { return static_cast<size_t>(mix64(key ^ 0x5bd1e9955bd1e995ULL)) & mask; }
+
+    std::atomic<uint64_t>& stripe(size_t b) const { return stripes_[b % kStripes].seq; }
+
+    void begin_write(size_t b) { stripe(b).fetch_add(1, std::memory_order_relaxed); std::atomic_thread_fence(std::memory_order_release); }
+    void end_write(size_t b) { stripe(b).fetch_add(1, std::memory_order_release); }
+
+    void publish(Table* t) {
+        tables_.emplace_back(t);
+        table_.store(t, std::memory_order_release);
+    }
+
+    Slot* locate(Table* t, uint64_t key, size_t& bucket) {
+        for (size_t b : { bucket1(key, t->mask), bucket2(key, t->mask) })
+            for (auto& s : t->buckets[b].slots)
+                if (s.key.load(std::memory_order_relaxed) == key) { bucket = b; return &s; }
+        return nullptr;
+    }
+
+    // Insert a new key, displacing others along a BFS path if needed
+    bool place(Table* t, uint64_t key, int64_t val) {
+        struct Node { size_t bucket; int parent; int slot; };
+        std::vector<Node> nodes;
+        std::unordered_set<size_t> seen;
+        for (size_t b : { bucket1(key, t->mask), bucket2(key, t->mask) })
+            if (seen.insert(b).second) nodes.push_back({ b, -1, -1 });
+        for (size_t n = 0; n < nodes.size() && nodes.size() < 2000; ++n) {
+            Bucket& bk = t->buckets[nodes[n].bucket];
+            for (int i = 0; i < 4; ++i) {
+                if (bk.slots[i].key.load(std::memory_order_relaxed) == 0) {
+                    // Walk back to the root, moving each occupant one step forward
+                    size_t dst = nodes[n].bucket;
+                    int dstSlot = i;
+                    for (int cur = static_cast<int>(n); nodes[cur].parent >= 0; cur = nodes[cur].parent) {
+                        const Node& from = nodes[nodes[cur].parent];
+                        Slot& src = t->buckets[from.bucket].slots[nodes[cur].slot];
+                        Slot& to = t->buckets[dst].slots[dstSlot];
+                        uint64_t k = src.key.load(std::memory_order_relaxed);
+                        int64_t v = src.val.load(std::memory_order_relaxed);
+                        begin_write(dst);
+                        to.val.store(v, std::memory_order_relaxed);
+                        to.key.store(k, std::memory_order_relaxed);
+                        end_write(dst);
+                        begin_write(from.bucket);
+                        src.key.store(0, std::memory_order_relaxed);
+                        end_write(from.bucket);
+                        dst = from.bucket;
+                        dstSlot = nodes[cur].slot;
+                    }
+                    Slot& to = t->buckets[dst].slots[dstSlot];
+                    begin_write(dst);
+                    to.val.store(val, std::memory_order_relaxed);
+                    to.key.store(key, std::memory_order_relaxed);
+                    end_write(dst);
+                    return true;
+                }
+            }
+            int depth = 0;
+            for (int p = nodes[n].parent; p >= 0; p = nodes[p].parent) ++depth;
+            if (depth >= kMaxPath) continue;
+            for (int i = 0; i < 4; ++i) {
+                uint64_t k = bk.slots[i].key.load(std::memory_order_relaxed);
+                size_t alt = bucket1(k, t->mask) == nodes[n].bucket ? bucket2(k, t->mask) : bucket1(k, t->mask);
+                if (seen.insert(alt).second) nodes.push_back({ alt, static_cast<int>(n), i });
+            }
+        }
+        return false;
+    }
+
+    // Double the table; readers still holding the old one retry on publish
+    Table* grow(Table* old) {
+        for (size_t n = (old->mask + 1) * 2;; n *= 2) {
+            std::unique_ptr<Table> t(new Table(n));
+            bool ok = true;
+            for (size_t b = 0; ok && b <= old->mask; ++b)
+                for (auto& s : old->buckets[b].slots) {
+                    uint64_t k = s.key.load(std::memory_order_relaxed);
+                    if (k && !place(t.get(), k, s.val.load(std::memory_order_relaxed))) { ok = false; break; }
+                }
+            if (!ok) continue;
+            Table* raw = t.release();
+            publish(raw);
+            return raw;
+        }
+    }
+
+    std::unique_ptr<Stripe[]> stripes_;
+    std::atomic<Table*> table_{ nullptr };
+    std::vector<std::unique_ptr<Table>> tables_;  // retired tables live as long as the index
+    size_t size_ = 0;
+};
+
+// ---- Metrics ----
+// Server telemetry in Prometheus text format. Each thread records into its
+// own ThreadMetrics with plain relaxed loads and stores, so the hot path
+// has no locked instructions and no shared cache lines. A scrape sums all
+// threads under the registry lock, and an exiting thread's totals are
+// folded into the registry. Latencies go into log-linear buckets, 8 per
+// power of two (about 12% precision, as in HDR histograms), and the
+// quantiles are read from those buckets.
+
+enum MetricMode { kMetricPhone, kMetricAddress, kMetricHash, kMetricBinary, kMetricModes };
+const char* const kMetricModeNames[kMetricModes] = { "phone", "address", "hash", "binary" };
+const int kLatencyBuckets = 62 * 8;   // nanoseconds, 8 sub-buckets per power of two
+
+struct ModeMetrics {
+    std::atomic<uint64_t> requests, hits, misses, errors, rows, bytes, coalesced, latencySumNs;
+    std::atomic<uint64_t> latency[kLatencyBuckets];
+};
+
+struct ThreadMetrics {
+    ModeMetrics modes[kMetricModes];
+    std::atomic<uint64_t> cuckooHit, cuckooAbsent, cuckooMulti;
+};
+
+// Add to a counter only its own thread writes
+inline void bump(std::atomic<uint64_t>& c, uint64_t n = 1) {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+inline int latency_bucket(uint64_t ns) {
+    if (ns < 8) return static_cast<int>(ns);
+    int msb = highest_bit64(ns);
+    return std::min(((msb - 2) << 3) + static_cast<int>((ns >> (msb - 3)) & 7), kLatencyBuckets - 1);
+}
+
+// Largest latency that lands in a bucket
+inline uint64_t latency_bucket_max(int b) {
+    if (b < 8) return static_cast<uint64_t>(b);
+    int msb = (b >> 3) + 2;
+    return ((uint64_t(8 + (b & 7)) + 1) << (msb - 3)) - 1;
+}
+
+class MetricsRegistry {
+public:
+    ThreadMetrics* add() {
+        auto* m = new ThreadMetrics();
+        std::lock_guard<std::mutex> lock(m_);
+        live_.push_back(m);
+        return m;
+    }
+
+    // Fold a finished thread's counts into the totals and free it
+    void retire(ThreadMetrics* m) {
+        std::lock_guard<std::mutex> lock(m_);
+        live_.erase(std::find(live_.begin(), live_.end(), m));
+        merge(retired_, *m);
+        delete m;
+    }
+
+    ThreadMetrics* snapshot() {
+        auto* sum = new ThreadMetrics();
+        std::lock_guard<std::mutex> lock(m_);
+        merge(*sum, retired_);
+        for (auto* m : live_) merge(*sum, *m);
+        return sum;
+    }
+
+private:
+    static void merge(ThreadMetrics& to, const ThreadMetrics& from) {
+        auto add = [](std::atomic<uint64_t>& a, const std::atomic<uint64_t>& b) {
+            a.store(a.load(std::memory_order_relaxed) + b.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        };
+        for (int i = 0; i < kMetricModes; ++i) {
+            ModeMetrics& a = to.modes[i];
+            const ModeMetrics& b = from.modes[i];
+            add(a.requests, b.requests);
+            add(a.hits, b.hits);
+            add(a.misses, b.misses);
+            add(a.errors, b.errors);
+            add(a.rows, b.rows);
+            add(a.bytes, b.bytes);
+            add(a.coalesced, b.coalesced);
+            add(a.latencySumNs, b.latencySumNs);
+            for (int k = 0; k < kLatencyBuckets; ++k) add(a.latency[k], b.latency[k]);
+        }
+        add(to.cuckooHit, from.cuckooHit);
+        add(to.cuckooAbsent, from.cuckooAbsent);
+        add(to.cuckooMulti, from.cuckooMulti);
+    }
+
+    std::mutex m_;
+    std::vector<ThreadMetrics*> live_;
+    ThreadMetrics retired_{};
+};
+
+// Never destroyed: detached threads may still retire their metrics at exit
+MetricsRegistry& metrics_registry() {
+    static auto* registry = new MetricsRegistry;
+    return *registry;
+}
+
+ThreadMetrics& thread_metrics() {
+    struct Slot {
+        ThreadMetrics* m = nullptr;
+        ~Slot() { if (m) metrics_registry().retire(m); }
+    };
+    thread_local Slot slot;
+    if (!slot.m) slot.m = metrics_registry().add();
+    return *slot.m;
+}
+
+MetricMode metric_mode(const std::string& mode) {
+    if (mode == "phone") return kMetricPhone;
+    if (mode == "address") return kMetricAddress;
+    if (mode == "hash") return kMetricHash;
+    return kMetricModes;
+}
+
+// Record one answered request
+void record_request(MetricMode mode, std::chrono::steady_clock::duration took, uint64_t rows, uint64_t bytes, bool error, bool coalesced) {
+    if (mode == kMetricModes) return;
+    ModeMetrics& m = thread_metrics().modes[mode];
+    uint64_t ns = static_cast<uint64_t>(std::max<long long>(0, std::chrono::duration_cast<std::chrono::nanoseconds>(took).count()));
+    bump(m.requests);
+    bump(error ? m.errors : rows ? m.hits : m.misses);
+    bump(m.rows, rows);
+    bump(m.bytes, bytes);
+    if (coalesced) bump(m.coalesced);
+    bump(m.latencySumNs, ns);
+    bump(m.latency[latency_bucket(ns)]);
+}
+
+std::string metrics_text() {
+    std::unique_ptr<ThreadMetrics> sum(metrics_registry().snapshot());
+    std::ostringstream out;
+    auto counter = [&](const char* name, const char* help, std::atomic<uint64_t> ModeMetrics::*field) {
+        out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " counter\n";
+        for (int i = 0; i < kMetricModes; ++i) out << name << "{mode=\"" << kMetricModeNames[i] << "\"} " << (sum->modes[i].*field).load() << "\n";
+    };
+    counter("lookup_requests_total", "Requests answered.", &ModeMetrics::requests);
+    counter("lookup_hits_total", "Requests that returned at least one row.", &ModeMetrics::hits);
+    counter("lookup_misses_total", "Requests that returned no rows.", &ModeMetrics::misses);
+    counter("lookup_errors_total", "Requests answered with an error.", &ModeMetrics::errors);
+    counter("lookup_rows_total", "Rows returned.", &ModeMetrics::rows);
+    counter("lookup_response_bytes_total", "Response bytes serialized.", &ModeMetrics::bytes);
+    counter("lookup_coalesced_total", "Requests answered by an identical lookup already running.", &ModeMetrics::coalesced);
+
+    out << "# HELP lookup_request_duration_seconds Time from reading a request to having its response.\n"
+        << "# TYPE lookup_request_duration_seconds summary\n";
+    for (int i = 0; i < kMetricModes; ++i) {
+        const ModeMetrics& m = sum->modes[i];
+        uint64_t n = 0;
+        for (auto& b : m.latency) n += b.load();
+        for (double q : { 0.5, 0.9, 0.99, 0.999, 0.9999 }) {
+            uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(n))), seen = 0;
+            int b = 0;
+            while (n && b < kLatencyBuckets - 1 && (seen += m.latency[b].load()) < rank) ++b;
+            out << "lookup_request_duration_seconds{mode=\"" << kMetricModeNames[i] << "\",quantile=\"" << q << "\"} "
+                << (n ? static_cast<double>(latency_bucket_max(b)) / 1e9 : 0.0) << "\n";
+        }
+        out << "lookup_request_duration_seconds_sum{mode=\"" << kMetricModeNames[i] << "\"} " << static_cast<double>(m.latencySumNs.load()) / 1e9 << "\n"
+            << "lookup_request_duration_seconds_count{mode=\"" << kMetricModeNames[i] << "\"} " << n << "\n";
+    }
+
+    out << "# HELP lookup_cuckoo_probes_total Digest probes of the in-memory cuckoo index.\n"
+        << "# TYPE lookup_cuckoo_probes_total counter\n"
+        << "lookup_cuckoo_probes_total{result=\"hit\"} " << sum->cuckooHit.load() << "\n"
+        << "lookup_cuckoo_probes_total{result=\"absent\"} " << sum->cuckooAbsent.load() << "\n"
+        << "lookup_cuckoo_probes_total{result=\"multi\"} " << sum->cuckooMulti.load() << "\n";
+    return out.str();
+}
+
+// Side indexes consulted before the SQL digest lookup
+struct DigestIndexes {
+    const MphfIndex* mphf = nullptr;
+    const PrefixIndex* prefix = nullptr;
+    const DigestCuckoo* cuckoo = nullptr;
+
+    bool empty() const { return !mphf && !prefix && !cuckoo; }
+};
+
+// Candidate rowids for the given hex digests from the side indexes.
+// Returns false when the indexes cannot answer and SQL must be used.
+bool probe_digest_indexes(const DigestIndexes& idx, const std::vector<std::string>& hexDigests, std::vector<long long>& rowids) {
+    TraceSpan trace("index probe");
+    unsigned char d[SHA256_DIGEST_LENGTH];
+    for (auto& h : hexDigests) {
+        if (!parse_hex_digest(h.data(), h.size(), d)) return false;
+        size_t before = rowids.size();
+        if (idx.mphf || idx.prefix) {
+            if (idx.mphf) idx.mphf->find(d, rowids);
+            else idx.prefix->find(d, rowids);
+            if (rowids.size() > before) LOOKUP_PROBE1(cache__hit, idx.mphf ? "mphf" : "prefix");
+            else LOOKUP_PROBE1(cache__miss, idx.mphf ? "mphf" : "prefix");
+            continue;
+        }
+        long long rowid;
+        ThreadMetrics& tm = thread_metrics();
+        switch (idx.cuckoo->find(DigestCuckoo::key_of(d), rowid)) {
+        case DigestCuckoo::Probe::Absent: bump(tm.cuckooAbsent); LOOKUP_PROBE1(cache__miss, "cuckoo"); break;
+        case DigestCuckoo::Probe::Hit: bump(tm.cuckooHit); LOOKUP_PROBE1(cache__hit, "cuckoo"); rowids.push_back(rowid); break;
+        case DigestCuckoo::Probe::Multi: bump(tm.cuckooMulti); LOOKUP_PROBE1(cache__miss, "cuckoo"); return false;
+        }
+    }
+    std::sort(rowids.begin(), rowids.end());
+    rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+    return true;
+}
+
+// Per-query options shared by the lookup functions
+struct LookupOptions {
+    DigestIndexes indexes;
+    std::vector<std::string> columns;   // project only these columns; empty means all
+};
+
+// SHA-256 of the empty string. addhash.py stores it for every NULL value,
+// so the partial digest indexes leave it out; lookups for it scan instead.
+const std::string kEmptySha256 = "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855";
+
+bool has_empty_digest(const std::vector<std::string>& hexDigests) {
+    return std::find(hexDigests.begin(), hexDigests.end(), kEmptySha256) != hexDigests.end();
+}
+
+// SELECT list for the requested columns, optionally qualified by a table alias
+std::string select_list(const std::vector<std::string>& columns, const std::string& alias = "") {
+    std::string q = alias.empty() ? "" : alias + ".";
+    if (columns.empty()) return q + "*";
+    std::string out;
+    for (auto& c : columns) out += (out.empty() ? "" : ", ") + q + '"' + c + '"';
+    return out;
+}
+
+// Equality on a digest column. Unless the empty digest is searched for, the
+// partial index predicate is repeated so SQLite can use the index built by
+// "build-index sql"
+std::string digest_match(const std::string& col, size_t params, bool partial) {
+    std::string m = "(\"" + col + "\"";
+    if (params == 1) m += " = ?";
+    else {
+        m += " IN (";
+        for (size_t i = 0; i < params; ++i) m += i ? ",?" : "?";
+        m += ')';
+    }
+    if (!partial) return m + ')';
+    return m + " AND \"" + col + "\" <> '" + kEmptySha256 + "')";
+}
+
+// Match on an index expression, repeating its predicate like digest_match
+std::string expr_match(const DigestExpr& e, size_t params) {
+    std::string m = "(" + e.expr + " IN (";
+    for (size_t i = 0; i < params; ++i) m += i ? ",?" : "?";
+    m += ')';
+    if (!e.where.empty()) m += " AND (" + e.where + ")";
+    return m + ")";
+}
+
+// Bind hex digests to expr_match placeholders, as blobs for sha256() indexes
+int bind_expr_digests(sqlite3_stmt* st, int idx, const DigestExpr& e, const std::vector<std::string>& hexDigests) {
+    for (auto& h : hexDigests) {
+        unsigned char d[SHA256_DIGEST_LENGTH];
+        if (!e.blob) sqlite3_bind_text(st, idx, h.c_str(), -1, SQLITE_TRANSIENT);
+        else if (parse_hex_digest(h.data(), h.size(), d)) sqlite3_bind_blob(st, idx, d, SHA256_DIGEST_LENGTH, SQLITE_TRANSIENT);
+        ++idx;
+    }
+    return idx;
+}
+
+// Fetch candidate rows by rowid, keeping those that really carry one of the digests
+std::vector<std::map<std::string, std::string>> fetch_verified_rows(
+    sqlite3* db,
+    const TableSchema& schema,
+    const std::string& table,
+    const std::vector<long long>& rowids,
+    const std::vector<std::string>& hexDigests,
+    bool withJson,
+    const std::vector<std::string>& columns
+) {
+    std::vector<std::map<std::string, std::string>> out;
+    if (rowids.empty()) return out;
+    TraceSpan trace("verify candidates", std::to_string(rowids.size()) + " rowids");
+    std::string sql = "SELECT * FROM '" + table + "' WHERE rowid = ?";
+    sqlite3_stmt* st;
+    if (prepare_statement(db, sql, &st) != SQLITE_OK) return out;
+    sqlite3_stmt* dt = nullptr;
+    if (!schema.digestTable.empty()) {
+        sql = "SELECT 1 FROM '" + schema.digestTable + "' WHERE digest = ? AND rid = ?";
+        prepare_statement(db, sql, &dt);
+    }
+    std::vector<sqlite3_stmt*> ex;
+    for (auto& e : schema.exprCols) {
+        sqlite3_stmt* es;
+        sql = "SELECT 1 FROM '" + table + "' WHERE rowid = ? AND " + expr_match(e, hexDigests.size());
+        if (prepare_statement(db, sql, &es) != SQLITE_OK) continue;
+        bind_expr_digests(es, 2, e, hexDigests);
+        ex.push_back(es);
+    }
+    for (long long rowid : rowids) {
+        sqlite3_bind_int64(st, 1, rowid);
+        auto rows = collect_rows(st);
+        sqlite3_reset(st);
+        for (auto& row : rows) {
+            bool match = false;
+            for (auto& h : hexDigests) {
+                for (auto& c : schema.shaCols) {
+                    auto it = row.find(c);
+                    if (it != row.end() && to_lower(it->second) == h) match = true;
+                }
+                if (withJson && schema.hasJson) {
+                    auto it = row.find("row_hashes");
+                    if (it == row.end()) {}
+                    else if (!schema.packedHashes) match |= it->second.find('"' + h + '"') != std::string::npos;
+                    else {
+                        // collect_rows hex-encodes the blob; only digest-aligned hits count
+                        for (size_t at = it->second.find(h); at != std::string::npos && !match; at = it->second.find(h, at + 1))
+                            match = at % (2 * SHA256_DIGEST_LENGTH) == 0;
+                    }
+                }
+                unsigned char d[SHA256_DIGEST_LENGTH];
+                if (!match && dt && parse_hex_digest(h.data(), h.size(), d)) {
+                    sqlite3_bind_blob(dt, 1, d, SHA256_DIGEST_LENGTH, SQLITE_TRANSIENT);
+                    sqlite3_bind_int64(dt, 2, rowid);
+                    match = sqlite3_step(dt) == SQLITE_ROW;
+                    sqlite3_reset(dt);
+                }
+            }
+            for (size_t k = 0; k < ex.size() && !match; ++k) {
+                sqlite3_bind_int64(ex[k], 1, rowid);
+                match = sqlite3_step(ex[k]) == SQLITE_ROW;
+                sqlite3_reset(ex[k]);
+            }
+            if (!match) continue;
+            if (!columns.empty()) {
+                std::map<std::string, std::string> projected;
+                for (auto& c : columns) projected[c] = c == "rowid" ? std::to_string(rowid) : row[c];
+                row.swap(projected);
+            }
+            out.push_back(std::move(row));
+        }
+    }
+    sqlite3_finalize(st);
+    sqlite3_finalize(dt);
+    for (auto* es : ex) sqlite3_finalize(es);
+    return out;
+}
+
+// Append the rowids a statement returns in its first column
+bool collect_rowids(sqlite3_stmt* st, std::vector<long long>& rowids) {
+    int rc;
+    while ((rc = sqlite3_step(st)) == SQLITE_ROW) rowids.push_back(sqlite3_column_int64(st, 0));
+    return rc == SQLITE_DONE;
+}
+
+// Fetch each of the rows once, in rowid order. A row can match through
+// several places its digests are kept (a sha column and row_hashes, or an
+// expression index reorganize copied into <table>_digests), so the lookups
+// gather rowids from all of them first.
+std::vector<std::map<std::string, std::string>> fetch_rows(
+    sqlite3* db,
+    const std::string& table,
+    std::vector<long long> rowids,
+    const std::vector<std::string>& columns
+) {
+    std::sort(rowids.begin(), rowids.end());
+    rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+    std::vector<std::map<std::string, std::string>> out;
+    if (rowids.empty()) return out;
+    sqlite3_stmt* st;
+    if (prepare_statement(db, "SELECT " + select_list(columns) + " FROM '" + table + "' WHERE rowid = ?", &st) != SQLITE_OK) return out;
+    for (long long rowid : rowids) {
+        sqlite3_bind_int64(st, 1, rowid);
+        auto rows = collect_rows(st);
+        sqlite3_reset(st);
+        for (auto& row : rows) out.push_back(std::move(row));
+    }
+    sqlite3_finalize(st);
+    return out;
+}
+
+// Rowids whose digests in the <table>_digests companion match any of the given ones
+void digest_table_rowids(
+    sqlite3* db,
+    const TableSchema& schema,
+    const std::vector<std::string>& hexDigests,
+    std::vector<long long>& rowids
+) {
+    std::vector<std::vector<unsigned char>> blobs;
+    for (auto& h : hexDigests) {
+        std::vector<unsigned char> d(SHA256_DIGEST_LENGTH);
+        if (parse_hex_digest(h.data(), h.size(), d.data())) blobs.push_back(std::move(d));
+    }
+    if (blobs.empty()) return;
+    std::ostringstream ss;
+    ss << "SELECT rid FROM '" << schema.digestTable << "' WHERE digest IN (";
+    for (size_t i = 0; i < blobs.size(); ++i) ss << (i ? ",?" : "?");
+    ss << ")";
+    sqlite3_stmt* st;
+    if (prepare_statement(db, ss.str(), &st) != SQLITE_OK) return;
+    for (size_t i = 0; i < blobs.size(); ++i)
+        sqlite3_bind_blob(st, static_cast<int>(i + 1), blobs[i].data(), SHA256_DIGEST_LENGTH, SQLITE_TRANSIENT);
+    collect_rowids(st, rowids);
+    sqlite3_finalize(st);
+}
+
+// Rowids whose expression-indexed digests match any of the given ones
+void digest_expr_rowids(
+    sqlite3* db,
+    const TableSchema& schema,
+    const std::string& table,
+    const std::vector<std::string>& hexDigests,
+    std::vector<long long>& rowids
+) {
+    if (schema.exprCols.empty() || hexDigests.empty()) return;
+    std::ostringstream ss;
+    ss << "SELECT rowid FROM '" << table << "' WHERE ";
+    for (size_t i = 0; i < schema.exprCols.size(); ++i) {
+        if (i) ss << " OR ";
+        ss << expr_match(schema.exprCols[i], hexDigests.size());
+    }
+    sqlite3_stmt* st;
+    if (prepare_statement(db, ss.str(), &st) != SQLITE_OK) return;
+    int idx = 1;
+    for (auto& e : schema.exprCols) idx = bind_expr_digests(st, idx, e, hexDigests);
+    collect_rowids(st, rowids);
+    sqlite3_finalize(st);
+}
+
+// Lookup by phone (international, any country)
+// Digests a phone number may be stored under: with and without a leading '+'
+std::vector<std::string> phone_hashes(const std::string& phone) {
+    // Strip non-digit characters, preserve '+' if present
+    bool has_plus = false;
+    std::string digits;
+    for (unsigned char c : phone) {
+        if (c == '+') has_plus = true;
+        if (std::isdigit(c)) digits.push_back(c);
+    }
+    // Build variants: always try both with and without '+' prefix
+    std::vector<std::string> variants;
+    if (has_plus) {
+        variants.push_back("+" + digits);
+        variants.push_back(digits);
+    }
+    else {
+        variants.push_back(digits);
+        variants.push_back("+" + digits);
+    }
+    // Compute hashes for each variant
+    std::vector<std::string> hashes;
+    for (auto& v : variants) hashes.push_back(sha256_hex(v));
+    return hashes;
+}
+
+std::vector<std::map<std::string, std::string>> lookup_by_phone(sqlite3* db, const TableSchema& schema, const std::string& table, const std::string& phone, const LookupOptions& opts = {}) {
+    std::vector<std::string> hashes = phone_hashes(phone);
+    const auto& shaCols = schema.shaCols;
+    if (shaCols.empty() && schema.exprCols.empty() && schema.digestTable.empty()) return {};
+    std::vector<long long> candidates;
+    bool empty = has_empty_digest(hashes);
+    if (!empty && !opts.indexes.empty() && probe_digest_indexes(opts.indexes, hashes, candidates)) {
+        // Candidates that all fail verification mean a stale index: fall back to SQL
+        auto rows = fetch_verified_rows(db, schema, table, candidates, hashes, false, opts.columns);
+        if (!rows.empty() || candidates.empty()) return rows;
+    }
+    std::vector<long long> rowids;
+    if (!schema.digestTable.empty()) digest_table_rowids(db, schema, hashes, rowids);
+    digest_expr_rowids(db, schema, table, hashes, rowids);
+    if (!shaCols.empty()) {
+        // Build query with placeholders
+        std::ostringstream ss;
+        ss << "SELECT rowid FROM '" << table << "' WHERE ";
+        for (size_t i = 0; i < shaCols.size(); ++i) {
+            if (i) ss << " OR ";
+            ss << digest_match(shaCols[i], hashes.size(), !empty);
+        }
+        sqlite3_stmt* st;
+        if (prepare_statement(db, ss.str(), &st) == SQLITE_OK) {
+            int idx = 1;
+            for (size_t i = 0; i < shaCols.size(); ++i)
+                for (auto& h : hashes) sqlite3_bind_text(st, idx++, h.c_str(), -1, SQLITE_TRANSIENT);
+            collect_rowids(st, rowids);
+            sqlite3_finalize(st);
+        }
+    }
+    return fetch_rows(db, table, rowids, opts.columns);
+}
+
+// Lookup by address
+std::vector<std::map<std::string, std::string>> lookup_by_address(sqlite3* db, const TableSchema& schema, const std::string& table, const std::string& q, const LookupOptions& opts = {}) {
+    std::vector<std::map<std::string, std::string>> result;
+    for (auto& col : schema.addrCols) {
+        std::string sql = "SELECT " + select_list(opts.columns) + ", '" + col + "' AS matched_col FROM '" + table + "' WHERE lower(\"" + col + "\") LIKE lower(?)";
+        sqlite3_stmt* st;
+        prepare_statement(db, sql, &st);
+        std::string pat = "%" + q + "%";
+        sqlite3_bind_text(st, 1, pat.c_str(), -1, SQLITE_TRANSIENT);
+        auto rows = collect_rows(st);
+        sqlite3_finalize(st);
+        result.insert(result.end(), rows.begin(), rows.end());
+    }
+    return result;
+}
+
+// Lookup by a hex digest, in every place a digest can be stored
+static std::vector<std::map<std::string, std::string>> lookup_by_digest(
+    sqlite3* db,
+    const TableSchema& schema,
+    const std::string& tbl,
+    const std::string& h,
+    const LookupOptions& opts = {}
+) {
+    bool hasJson = schema.hasJson;
+    const auto& shaCols = schema.shaCols;
+    std::vector<long long> candidates;
+    bool empty = h == kEmptySha256;
+    if (!empty && !opts.indexes.empty() && probe_digest_indexes(opts.indexes, { h }, candidates)) {
+        auto rows = fetch_verified_rows(db, schema, tbl, candidates, { h }, true, opts.columns);
+        if (!rows.empty() || candidates.empty()) return rows;
+    }
+
+    // Digests moved out by reorganize, and those computed by expression indexes
+    std::vector<long long> rowids;
+    if (!schema.digestTable.empty()) digest_table_rowids(db, schema, { h }, rowids);
+    digest_expr_rowids(db, schema, tbl, { h }, rowids);
+
+    // JSON array lookup
+    if (hasJson) {
+        std::string jsql = schema.packedHashes
+            ? "SELECT rowid FROM '" + tbl + "' WHERE digest_in(row_hashes, ?)"
+            : "SELECT t.rowid FROM '" + tbl + "' t, json_each(t.row_hashes) je WHERE je.value = ?";
+        sqlite3_stmt* js;
+        if (prepare_statement(db, jsql, &js) == SQLITE_OK) {
+            sqlite3_bind_text(js, 1, h.c_str(), -1, SQLITE_TRANSIENT);
+            collect_rowids(js, rowids);
+            sqlite3_finalize(js);
+        }
+    }
+
+    // Direct SHA column lookup
+    if (!shaCols.empty()) {
+        std::ostringstream qss;
+        qss << "SELECT rowid FROM '" << tbl << "' WHERE ";
+        for (size_t i = 0; i < shaCols.size(); ++i) {
+            if (i) qss << " OR ";
+            qss << digest_match(shaCols[i], 1, !empty);
+        }
+        sqlite3_stmt* ss;
+        if (prepare_statement(db, qss.str(), &ss) == SQLITE_OK) {
+            for (size_t i = 0; i < shaCols.size(); ++i) {
+                sqlite3_bind_text(ss, static_cast<int>(i + 1), h.c_str(), -1, SQLITE_TRANSIENT);
+            }
+            collect_rowids(ss, rowids);
+            sqlite3_finalize(ss);
+        }
+    }
+
+    // Every source adds candidates; each matching row is fetched once
+    return fetch_rows(db, tbl, rowids, opts.columns);
+}
+
+// Lookup by hash
+static std::vector<std::map<std::string, std::string>> lookup_by_hash(
+    sqlite3* db,
+    const TableSchema& schema,
+    const std::string& tbl,
+    const std::string& raw,
+    const LookupOptions& opts = {}
+) {
+    std::string h = sha256_hex(raw);
+    return lookup_by_digest(db, schema, tbl, h, opts);
+}
+
+// Partial indexes on every digest column, skipping NULL and empty-string
+// digests; optional extra columns make them covering for --columns lookups
+int build_sql_indexes(sqlite3* db, const std::string& table, const TableSchema& schema, const std::vector<std::string>& cover) {
+    if (schema.shaCols.empty()) { std::cerr << "No digest columns to index\n"; return 1; }
+    for (auto& col : schema.shaCols) {
+        std::string name = table + "_" + col + "_idx";
+        std::string sql = "CREATE INDEX IF NOT EXISTS \"" + name + "\" ON \"" + table + "\" (\"" + col + "\"";
+        for (auto& c : cover) sql += ", \"" + c + "\"";
+        sql += ") WHERE \"" + col + "\" IS NOT NULL AND \"" + col + "\" <> '" + kEmptySha256 + "'";
+        if (!exec_sql(db, sql)) return 1;
+        std::cout << "Indexed " << col << " as " << name << "\n";
+    }
+    return 0;
+}
+
+// Expression indexes computing the digest of source columns on the fly,
+// so no stored hash column is needed. Phone columns are canonicalized
+// first, matching the '+'-prefixed variant lookup_by_phone hashes.
+int build_expr_indexes(sqlite3* db, const std::string& table, const std::vector<std::string>& sources) {
+    if (sources.empty()) { std::cerr << "Missing --source columns\n"; return 1; }
+    for (auto& col : sources) {
+        std::string name = table + "_" + col + "_sha256_idx";
+        std::string arg = '"' + col + '"';
+        if (to_lower(col).find("phone") != std::string::npos) arg = "phone_canon(" + arg + ")";
+        std::string sql = "CREATE INDEX IF NOT EXISTS \"" + name + "\" ON \"" + table + "\" (sha256_hex(" + arg + ")) "
+            "WHERE \"" + col + "\" IS NOT NULL AND \"" + col + "\" <> ''";
+        if (!exec_sql(db, sql)) return 1;
+        std::cout << "Indexed sha256_hex(" << arg << ") as " << name << "\n";
+    }
+    return 0;
+}
+
+// Rewrite JSON row_hashes arrays as packed blobs of 32-byte digests, which
+// digest_in scans without parsing. All-or-nothing: a non-digest entry
+// aborts the conversion so the table never mixes both formats.
+int pack_row_hashes(sqlite3* db, const std::string& table) {
+    if (!read_table_schema(db, table).hasJson) { std::cerr << "No row_hashes column\n"; return 1; }
+    if (!exec_sql(db, "BEGIN IMMEDIATE")) return 1;
+    sqlite3_stmt* sel = nullptr;
+    sqlite3_stmt* arr = nullptr;
+    sqlite3_stmt* upd = nullptr;
+    auto fail = [&](const std::string& msg) {
+        std::cerr << msg << "\n";
+        sqlite3_finalize(sel);
+        sqlite3_finalize(arr);
+        sqlite3_finalize(upd);
+        exec_sql(db, "ROLLBACK");
+        return 1;
+    };
+    std::string sql = "SELECT rowid, row_hashes FROM '" + table + "' WHERE typeof(row_hashes) = 'text'";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &sel, nullptr) != SQLITE_OK
+        || sqlite3_prepare_v2(db, "SELECT value FROM json_each(?)", -1, &arr, nullptr) != SQLITE_OK)
+        return fail(sqlite3_errmsg(db));
+    sql = "UPDATE '" + table + "' SET row_hashes = ? WHERE rowid = ?";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &upd, nullptr) != SQLITE_OK) return fail(sqlite3_errmsg(db));
+
+    long long rows = 0, digests = 0;
+    std::vector<unsigned char> packed;
+    int rc;
+    while ((rc = sqlite3_step(sel)) == SQLITE_ROW) {
+        long long rowid = sqlite3_column_int64(sel, 0);
+        packed.clear();
+        sqlite3_bind_text(arr, 1, reinterpret_cast<const char*>(sqlite3_column_text(sel, 1)), sqlite3_column_bytes(sel, 1), SQLITE_TRANSIENT);
+        int ac;
+        while ((ac = sqlite3_step(arr)) == SQLITE_ROW) {
+            unsigned char d[SHA256_DIGEST_LENGTH];
+            const char* h = reinterpret_cast<const char*>(sqlite3_column_text(arr, 0));
+            if (!h || !parse_hex_digest(h, static_cast<size_t>(sqlite3_column_bytes(arr, 0)), d))
+                return fail("Row " + std::to_string(rowid) + ": row_hashes entry is not a SHA-256 digest");
+            packed.insert(packed.end(), d, d + SHA256_DIGEST_LENGTH);
+        }
+        sqlite3_reset(arr);
+        if (ac != SQLITE_DONE) return fail("Row " + std::to_string(rowid) + ": " + sqlite3_errmsg(db));
+        sqlite3_bind_blob(upd, 1, packed.data(), static_cast<int>(packed.size()), SQLITE_STATIC);
+        sqlite3_bind_int64(upd, 2, rowid);
+        if (sqlite3_step(upd) != SQLITE_DONE) return fail(sqlite3_errmsg(db));
+        sqlite3_reset(upd);
+        ++rows;
+        digests += static_cast<long long>(packed.size() / SHA256_DIGEST_LENGTH);
+    }
+    if (rc != SQLITE_DONE) return fail(sqlite3_errmsg(db));
+    sqlite3_finalize(sel);
+    sqlite3_finalize(arr);
+    sqlite3_finalize(upd);
+    sel = arr = upd = nullptr;
+    if (!exec_sql(db, "COMMIT")) return fail("Commit failed");
+    std::cout << "Packed " << digests << " digests in " << rows << " rows of " << table << "\n";
+    return 0;
+}
+
+// ---- Ingest ----
+// Loads a CSV file (header row first) or the INSERT statements of a .sql
+// dump into a table, computing <column>_sha256 digests on the way, so no
+// separate addhash.py pass is needed. The main thread reads the file in
+// large chunks and parses it into batches; worker threads hash them and a
+// writer thread inserts them in file order, committing every --batch rows.
+
+struct Field {
+    std::string text;
+    bool null = false;
+};
+using Record = std::vector<Field>;
+
+// Incremental RFC 4180 reader. Quoted fields may hold commas, doubled
+// quotes and newlines; empty unquoted fields are NULL.
+class CsvParser {
+public:
+    template <class Emit>
+    void feed(const char* p, size_t n, Emit&& emit) {
+        for (size_t i = 0; i < n; ++i) {
+            char c = p[i];
+            switch (state_) {
+            case State::Start:
+                if (c == '"') { state_ = State::Quoted; quoted_ = true; }
+                else if (c == ',') end_field();
+                else if (c == '\n') end_record(emit);
+                else if (c != '\r') { field_.push_back(c); state_ = State::Plain; }
+                break;
+            case State::Plain:
+                if (c == ',') end_field();
+                else if (c == '\n') end_record(emit);
+                else if (c != '\r') field_.push_back(c);
+                break;
+            case State::Quoted:
+                if (c == '"') state_ = State::QuoteSeen;
+                else field_.push_back(c);
+                break;
+            case State::QuoteSeen:
+                if (c == '"') { field_.push_back('"'); state_ = State::Quoted; }
+                else if (c == ',') end_field();
+                else if (c == '\n') end_record(emit);
+                else if (c != '\r') { field_.push_back(c); state_ = State::Plain; }
+                break;
+            }
+        }
+    }
+
+    template <class Emit>
+    void finish(Emit&& emit) {
+        if (state_ != State::Start || !record_.empty()) end_record(emit);
+    }
+
+private:
+    enum class State { Start, Plain, Quoted, QuoteSeen };
+
+    void end_field() {
+        bool null = !quoted_ && field_.empty();
+        record_.push_back({ std::move(field_), null });
+        field_.clear();
+        quoted_ = false;
+        state_ = State::Start;
+    }
+
+    template <class Emit>
+    void end_record(Emit& emit) {
+        end_field();
+        if (record_.size() == 1 && record_[0].null) { record_.clear(); return; } // blank line
+        emit(std::move(record_));
+        record_.clear();
+    }
+
+    State state_ = State::Start;
+    std::string field_;
+    bool quoted_ = false;
+    Record record_;
+};
+
+// Splits a SQL dump into statements and turns INSERTs into the target
+// table into records. Column names come from the INSERT column list or
+// the table's CREATE TABLE. Backslash escapes are honored once a backtick
+// shows the dump is from MySQL.
+class SqlDumpParser {
+public:
+    explicit SqlDumpParser(const std::string& table) : table_(to_lower(table)) {}
+
+    std::vector<std::string> columns;
+    std::string error;
+
+    template <class Emit>
+    void feed(const char* p, size_t n, Emit&& emit) {
+        for (size_t i = 0; i < n && error.empty(); ++i) {
+            char c = p[i];
+            switch (state_) {
+            case State::Normal:
+                if (c == ';') { handle(emit); stmt_.clear(); continue; }
+                if (c == '\'') state_ = State::Single;
+                else if (c == '"') state_ = State::Double;
+                else if (c == '`') { state_ = State::Back; mysql_ = true; }
+                else if (c == '-' && !stmt_.empty() && stmt_.back() == '-') { stmt_.pop_back(); state_ = State::LineComment; continue; }
+                else if (c == '*' && !stmt_.empty() && stmt_.back() == '/') { stmt_.pop_back(); state_ = State::BlockComment; prev_ = 0; continue; }
+                break;
+            case State::Single:
+                if (escape_) escape_ = false;
+                else if (c == '\\' && mysql_) escape_ = true;
+                else if (c == '\'') state_ = State::Normal;
+                break;
+            case State::Double:
+                if (c == '"') state_ = State::Normal;
+                break;
+            case State::Back:
+                if (c == '`') state_ = State::Normal;
+                break;
+            case State::LineComment:
+                if (c == '\n') state_ = State::Normal;
+                continue;
+            case State::BlockComment:
+                if (c == '/' && prev_ == '*') state_ = State::Normal;
+                prev_ = c;
+                continue;
+            }
+            stmt_.push_back(c);
+        }
+    }
+
+    template <class Emit>
+    void finish(Emit&& emit) {
+        if (error.empty()) handle(emit);
+        stmt_.clear();
+    }
+
+private:
+    enum class State { Normal, Single, Double, Back, LineComment, BlockComment };
+
+    void skip_ws() { while (pos_ < stmt_.size() && std::isspace(static_cast<unsigned char>(stmt_[pos_]))) ++pos_; }
+
+    std::string word() {
+        skip_ws();
+        size_t start = pos_;
+        while (pos_ < stmt_.size() && (std::isalnum(static_cast<unsigned char>(stmt_[pos_])) || stmt_[pos_] == '_')) ++pos_;
+        return to_lower(stmt_.substr(start, pos_ - start));
+    }
+
+    // Identifier, possibly quoted or schema-qualified; returns the last part
+    std::string identifier() {
+        std::string name;
+        do {
+            skip_ws();
+            if (pos_ >= stmt_.size()) return name;
+            char open = stmt_[pos_];
+            char close = open == '[' ? ']' : open;
+            if (open == '"' || open == '`' || open == '[') {
+                size_t end = stmt_.find(close, pos_ + 1);
+                if (end == std::string::npos) end = stmt_.size();
+                name = stmt_.substr(pos_ + 1, end - pos_ - 1);
+                pos_ = end + 1;
+            }
+            else {
+                size_t start = pos_;
+                while (pos_ < stmt_.size() && (std::isalnum(static_cast<unsigned char>(stmt_[pos_])) || stmt_[pos_] == '_' || stmt_[pos_] == '$')) ++pos_;
+                name = stmt_.substr(start, pos_ - start);
+            }
+        } while (pos_ < stmt_.size() && stmt_[pos_] == '.' && ++pos_);
+        return name;
+    }
+
+    Field value() {
+        skip_ws();
+        Field f;
+        if (pos_ < stmt_.size() && stmt_[pos_] == '\'') {
+            for (++pos_; pos_ < stmt_.size(); ++pos_) {
+                char c = stmt_[pos_];
+                if (c == '\\' && mysql_ && pos_ + 1 < stmt_.size()) {
+                    char e = stmt_[++pos_];
+                    f.text.push_back(e == 'n' ? '\n' : e == 't' ? '\t' : e == 'r' ? '\r' : e == '0' ? '\0' : e);
+                }
+                else if (c == '\'' && pos_ + 1 < stmt_.size() && stmt_[pos_ + 1] == '\'') { f.text.push_back('\''); ++pos_; }
+                else if (c == '\'') { ++pos_; break; }
+                else f.text.push_back(c);
+            }
+            return f;
+        }
+        size_t start = pos_;
+        while (pos_ < stmt_.size() && stmt_[pos_] != ',' && stmt_[pos_] != ')' && !std::isspace(static_cast<unsigned char>(stmt_[pos_]))) ++pos_;
+        f.text = stmt_.substr(start, pos_ - start);
+        f.null = to_lower(f.text) == "null";
+        if (f.null) f.text.clear();
+        return f;
+    }
+
+    bool expect(char c) {
+        skip_ws();
+        if (pos_ < stmt_.size() && stmt_[pos_] == c) { ++pos_; return true; }
+        return false;
+    }
+
+    void create_table() {
+        std::string w = word();
+        while (!w.empty() && w != "table") w = word();
+        if (w.empty()) return;
+        size_t save = pos_;
+        if (word() != "if" || word() != "not" || word() != "exists") pos_ = save;
+        if (to_lower(identifier()) != table_ || !expect('(')) return;
+        std::vector<std::string> cols;
+        static const char* constraints[] = { "primary", "key", "unique", "constraint", "index", "foreign", "check", "fulltext", "spatial" };
+        while (pos_ < stmt_.size()) {
+            size_t start = pos_;
+            std::string name = identifier();
+            std::string lc = to_lower(name);
+            if (std::none_of(std::begin(constraints), std::end(constraints), [&](const char* k) { return lc == k; }) && !name.empty())
+                cols.push_back(name);
+            // skip the rest of the definition
+            int depth = 0;
+            if (pos_ == start) ++pos_;
+            for (; pos_ < stmt_.size(); ++pos_) {
+                char c = stmt_[pos_];
+                if (c == '(') ++depth;
+                else if (c == ')' && depth-- == 0) return void(columns = cols);
+                else if (c == ',' && depth == 0) { ++pos_; break; }
+                else if (c == '\'') pos_ = std::min(stmt_.find('\'', pos_ + 1), stmt_.size());
+            }
+        }
+    }
+
+    template <class Emit>
+    void insert(Emit& emit) {
+        std::string w = word();
+        while (!w.empty() && w != "into") w = word();
+        if (w.empty() || to_lower(identifier()) != table_) return;
+        std::vector<std::string> cols;
+        if (expect('(')) {
+            do cols.push_back(identifier()); while (expect(','));
+            if (!expect(')')) { error = "Malformed INSERT column list"; return; }
+        }
+        if (!cols.empty()) {
+            if (columns.empty()) columns = cols;
+            else if (cols != columns) { error = "INSERT column lists differ between statements"; return; }
+        }
+        if (columns.empty()) { error = "INSERT without column list and no CREATE TABLE for " + table_; return; }
+        if (word() != "values") return;
+        do {
+            if (!expect('(')) { error = "Malformed VALUES tuple"; return; }
+            Record r;
+            do r.push_back(value()); while (expect(','));
+            if (!expect(')')) { error = "Malformed VALUES tuple"; return; }
+            emit(std::move(r));
+        } while (expect(','));
+    }
+
+    template <class Emit>
+    void handle(Emit& emit) {
+        pos_ = 0;
+        std::string w = word();
+        if (w == "create") create_table();
+        else if (w == "insert" || w == "replace") insert(emit);
+    }
+
+    std::string table_;
+    std::string stmt_;
+    size_t pos_ = 0;
+    State state_ = State::Normal;
+    bool escape_ = false;
+    bool mysql_ = false;
+    char prev_ = 0;
+};
+
+// Reads an input file as a sequence of large chunks. .gz and .zst files are
+// decompressed on their own thread, which hands full buffers to the reader
+// through a short queue so decompression overlaps parsing and hashing.
+// Compressed inputs need the LOOKUP_ZLIB / LOOKUP_ZSTD build flags.
+class InputStream {
+public:
+    ~InputStream() { close(); }
+
+    // Opens path; compression is chosen by extension, which is then
+    // stripped so the caller sees the inner format (e.g. ".csv")
+    bool open(const std::string& path, std::string& innerExt) {
+        auto p = std::filesystem::u8path(path);
+        std::string ext = to_lower(p.extension().u8string());
+        codec_ = ext == ".gz" ? Codec::Gzip : ext == ".zst" ? Codec::Zstd : Codec::Plain;
+        innerExt = codec_ == Codec::Plain ? ext : to_lower(p.stem().extension().u8string());
+#ifndef LOOKUP_ZLIB
+        if (codec_ == Codec::Gzip) { error = "Built without gzip support (define LOOKUP_ZLIB and link zlib)"; return false; }
+#endif
+#ifndef LOOKUP_ZSTD
+        if (codec_ == Codec::Zstd) { error = "Built without zstd support (define LOOKUP_ZSTD and link libzstd)"; return false; }
+#endif
+        file_.open(p, std::ios::binary);
+        if (!file_) { error = "Cannot open " + path; return false; }
+        if (codec_ != Codec::Plain) worker_ = std::thread(&InputStream::decompress, this);
+        return true;
+    }
+
+    // Next chunk of decompressed bytes; false at end of input or on error
+    bool next(std::vector<char>& chunk) {
+        if (codec_ == Codec::Plain) {
+            chunk.resize(kChunk);
+            file_.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            chunk.resize(static_cast<size_t>(file_.gcount()));
+            return !chunk.empty();
+        }
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&] { return done_ || !ready_.empty(); });
+        if (ready_.empty()) return false;
+        chunk.swap(ready_.front());
+        ready_.pop_front();
+        cv_.notify_all();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (worker_.joinable()) worker_.join();
+    }
+
+    std::string error;  // set by open, or by the decompressor before it ends the stream
+
+private:
+    enum class Codec { Plain, Gzip, Zstd };
+    static const size_t kChunk = 4 << 20;
+    static const size_t kQueued = 4;
+
+    // Queue a full buffer, waiting while the parser is behind; false once closed
+    bool hand_over(std::vector<char>& out) {
+        std::unique_lock<std::mutex> lock(m_);
+        cv_.wait(lock, [&] { return stop_ || ready_.size() < kQueued; });
+        if (stop_) return false;
+        ready_.push_back(std::move(out));
+        cv_.notify_all();
+        out.clear();
+        out.reserve(kChunk);
+        return true;
+    }
+
+    void finish(const std::string& err) {
+        std::lock_guard<std::mutex> lock(m_);
+        if (!err.empty()) error = err;
+        done_ = true;
+        cv_.notify_all();
+    }
+
+    void decompress() {
+        std::vector<char> in(1 << 20), out;
+        out.reserve(kChunk);
+        std::string err;
+#ifdef LOOKUP_ZLIB
+        if (codec_ == Codec::Gzip) {
+            z_stream zs{};
+            inflateInit2(&zs, 15 + 32);   // gzip or zlib header
+            int rc = Z_OK;
+            while (err.empty()) {
+                if (zs.avail_in == 0) {
+                    file_.read(in.data(), static_cast<std::streamsize>(in.size()));
+                    zs.next_in = reinterpret_cast<Bytef*>(in.data());
+                    zs.avail_in = static_cast<uInt>(file_.gcount());
+                    if (zs.avail_in == 0) {
+                        if (rc != Z_STREAM_END) err = "Truncated gzip input";
+                        break;
+                    }
+                }
+                // Concatenated members, as written by parallel compressors
+                if (rc == Z_STREAM_END) inflateReset(&zs);
+                size_t have = out.size();
+                out.resize(kChunk);
+                zs.next_out = reinterpret_cast<Bytef*>(out.data() + have);
+                zs.avail_out = static_cast<uInt>(kChunk - have);
+                rc = inflate(&zs, Z_NO_FLUSH);
+                out.resize(kChunk - zs.avail_out);
+                if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) err = zs.msg ? zs.msg : "Corrupt gzip input";
+                else if (out.size() == kChunk && !hand_over(out)) break;
+            }
+            inflateEnd(&zs);
+        }
+#endif
+#ifdef LOOKUP_ZSTD
+        if (codec_ == Codec::Zstd) {
+            ZSTD_DStream* zs = ZSTD_createDStream();
+            size_t rc = 0;
+            ZSTD_inBuffer ib{ in.data(), 0, 0 };
+            while (err.empty()) {
+                if (ib.pos == ib.size) {
+                    file_.read(in.data(), static_cast<std::streamsize>(in.size()));
+                    ib = { in.data(), static_cast<size_t>(file_.gcount()), 0 };
+                    if (ib.size == 0) {
+                        if (rc != 0) err = "Truncated zstd input";
+                        break;
+                    }
+                }
+                size_t have = out.size();
+                out.resize(kChunk);
+                ZSTD_outBuffer ob{ out.data(), kChunk, have };
+                rc = ZSTD_decompressStream(zs, &ob, &ib);
+                out.resize(ob.pos);
+                if (ZSTD_isError(rc)) err = ZSTD_getErrorName(rc);
+                else if (out.size() == kChunk && !hand_over(out)) break;
+            }
+            ZSTD_freeDStream(zs);
+        }
+#endif
+        if (err.empty() && !out.empty()) hand_over(out);
+        finish(err);
+    }
+
+    Codec codec_ = Codec::Plain;
+    std::ifstream file_;
+    std::thread worker_;
+    std::mutex m_;
+    std::condition_variable cv_;
+    std::deque<std::vector<char>> ready_;
+    bool done_ = false, stop_ = false;
+};
+
+struct IngestBatch {
+    std::vector<Record> rows;
+    std::vector<std::string> digests;   // rows x hashed columns; empty means NULL
+    bool hashed = false;
+};
+
+struct IngestOptions {
+    std::vector<std::string> hashCols;  // columns to digest; empty means all
+    unsigned threads = 0;               // hashing workers; 0 picks from the core count
+    long long txRows = 100000;          // rows per transaction
+    bool unjournaled = false;           // initial load: journal_mode=MEMORY, synchronous=OFF
+};
+
+int ingest_file(sqlite3* db, const std::string& table, const std::string& path, const IngestOptions& opts) {
+    InputStream in;
+    std::string ext;
+    if (!in.open(path, ext)) { std::cerr << in.error << "\n"; return 1; }
+    if (ext != ".csv" && ext != ".sql") { std::cerr << "Unsupported input " << path << " (expected .csv or .sql, optionally .gz/.zst)\n"; return 1; }
+
+    // An initial load skips fsync and keeps its rollback journal in memory:
+    // a failed insert still rolls back cleanly, but a crash mid-load can
+    // leave the file corrupt, so reload into a fresh file. Loads into live
+    // databases run in WAL mode (see run()).
+    if (opts.unjournaled) {
+        exec_sql(db, "PRAGMA journal_mode=MEMORY");
+        exec_sql(db, "PRAGMA synchronous=OFF");
+    }
+    exec_sql(db, "PRAGMA cache_size=-262144");
+
+    const size_t kBatchRows = 4096;
+    unsigned cores = std::thread::hardware_concurrency();
+    unsigned workers = opts.threads ? opts.threads : cores > 1 ? cores - 1 : 1;
+    std::vector<std::string> columns;
+    std::vector<size_t> hashIdx;
+    sqlite3_stmt* ins = nullptr;
+    std::string error;
+    long long inserted = 0;
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<std::shared_ptr<IngestBatch>> pending, ordered;
+    bool finished = false, failed = false;
+    std::vector<std::thread> threads;
+
+    auto hasher = [&]() {
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+            cv.wait(lock, [&] { return finished || !pending.empty(); });
+            if (pending.empty()) return;
+            auto b = pending.front();
+            pending.pop_front();
+            lock.unlock();
+            b->digests.reserve(b->rows.size() * hashIdx.size());
+            for (auto& r : b->rows)
+                for (size_t k : hashIdx) b->digests.push_back(r[k].null || r[k].text.empty() ? std::string() : sha256_hex(r[k].text));
+            lock.lock();
+            b->hashed = true;
+            cv.notify_all();
+        }
+    };
+    auto writer = [&]() {
+        bool ok = exec_sql(db, "BEGIN");
+        long long inTx = 0;
+        std::unique_lock<std::mutex> lock(m);
+        for (;;) {
+            cv.wait(lock, [&] { return (!ordered.empty() && ordered.front()->hashed) || (finished && ordered.empty()); });
+            if (ordered.empty()) break;
+            auto b = ordered.front();
+            ordered.pop_front();
+            cv.notify_all();
+            lock.unlock();
+            size_t d = 0;
+            for (auto& r : b->rows) {
+                if (!ok) break;
+                int p = 1;
+                for (auto& f : r) {
+                    if (f.null) sqlite3_bind_null(ins, p++);
+                    else sqlite3_bind_text(ins, p++, f.text.data(), static_cast<int>(f.text.size()), SQLITE_STATIC);
+                }
+                for (size_t k = 0; k < hashIdx.size(); ++k, ++d) {
+                    if (b->digests[d].empty()) sqlite3_bind_null(ins, p++);
+                    else sqlite3_bind_text(ins, p++, b->digests[d].c_str(), -1, SQLITE_STATIC);
+                }
+                ok = sqlite3_step(ins) == SQLITE_DONE;
+                if (!ok) std::cerr << sqlite3_errmsg(db) << "\n";
+                sqlite3_reset(ins);
+                if (!ok) break;
+                ++inserted;
+                if (++inTx >= opts.txRows) {
+                    ok = exec_sql(db, "COMMIT") && exec_sql(db, "BEGIN");
+                    inTx = 0;
+                    std::cerr << "\rIngested " << inserted << " rows" << std::flush;
+                }
+            }
+            lock.lock();
+            if (!ok) failed = true;
+        }
+        lock.unlock();
+        if (ok) exec_sql(db, "COMMIT");
+        else exec_sql(db, "ROLLBACK");
+    };
+
+    // Create the table and start the pipeline once the column names are known
+    auto start = [&](const std::vector<std::string>& cols) {
+        columns = cols;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i].empty()) columns[i] = "c" + std::to_string(i + 1);
+            bool wanted = opts.hashCols.empty()
+                ? !ends_with_ci(columns[i], "_sha256") && !ends_with_ci(columns[i], "_sha")
+                : std::find(opts.hashCols.begin(), opts.hashCols.end(), columns[i]) != opts.hashCols.end();
+            if (wanted) hashIdx.push_back(i);
+        }
+        for (auto& h : opts.hashCols)
+            if (std::find(columns.begin(), columns.end(), h) == columns.end()) { error = "No column " + h + " in " + path; return false; }
+        std::string create = "CREATE TABLE IF NOT EXISTS \"" + table + "\" (";
+        std::string insert = "INSERT INTO \"" + table + "\" (";
+        std::string params;
+        for (size_t i = 0; i < columns.size() + hashIdx.size(); ++i) {
+            std::string col = i < columns.size() ? columns[i] : columns[hashIdx[i - columns.size()]] + "_sha256";
+            create += (i ? ", \"" : "\"") + col + '"';
+            insert += (i ? ", \"" : "\"") + col + '"';
+            params += i ? ",?" : "?";
+        }
+        if (!exec_sql(db, create + ")")) { error = "Cannot create " + table; return false; }
+        if (sqlite3_prepare_v2(db, (insert + ") VALUES (" + params + ")").c_str(), -1, &ins, nullptr) != SQLITE_OK) {
+            error = sqlite3_errmsg(db);
+            return false;
+        }
+        for (unsigned i = 0; i < workers; ++i) threads.emplace_back(hasher);
+        threads.emplace_back(writer);
+        return true;
+    };
+
+    auto batch = std::make_shared<IngestBatch>();
+    long long records = 0;
+    auto flush = [&]() {
+        if (batch->rows.empty()) return;
+        std::unique_lock<std::mutex> lock(m);
+        // Bound memory: at most a few batches per worker in flight
+        cv.wait(lock, [&] { return failed || ordered.size() < 4 * workers + 4; });
+        pending.push_back(batch);
+        ordered.push_back(batch);
+        cv.notify_all();
+        lock.unlock();
+        batch = std::make_shared<IngestBatch>();
+    };
+
+    CsvParser csv;
+    SqlDumpParser sql(table);
+    bool header = true;
+    auto on_record = [&](Record&& r) {
+        if (!error.empty()) return;
+        if (ext == ".csv" && header) {
+            header = false;
+            std::vector<std::string> names;
+            for (auto& f : r) names.push_back(f.text);
+            start(names);
+            return;
+        }
+        if (columns.empty() && !start(sql.columns)) return;
+        ++records;
+        if (r.size() != columns.size()) {
+            error = "Record " + std::to_string(records) + " has " + std::to_string(r.size()) + " fields, expected " + std::to_string(columns.size());
+            return;
+        }
+        batch->rows.push_back(std::move(r));
+        if (batch->rows.size() >= kBatchRows) flush();
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<char> buf;
+    while (error.empty() && sql.error.empty() && in.next(buf)) {
+        if (ext == ".csv") csv.feed(buf.data(), buf.size(), on_record);
+        else sql.feed(buf.data(), buf.size(), on_record);
+        std::lock_guard<std::mutex> lock(m);
+        if (failed) break;
+    }
+    in.close();
+    if (error.empty()) error = in.error;
+    if (ext == ".csv") csv.finish(on_record);
+    else sql.finish(on_record);
+    if (error.empty()) error = sql.error;
+    if (error.empty()) flush();
+    {
+        std::lock_guard<std::mutex> lock(m);
+        finished = true;
+        if (!error.empty()) { pending.clear(); ordered.clear(); }
+    }
+    cv.notify_all();
+    for (auto& t : threads) t.join();
+    sqlite3_finalize(ins);
+    if (!threads.empty()) std::cerr << "\n";
+    if (!error.empty()) { std::cerr << error << "\n"; return 1; }
+    if (failed) { std::cerr << "Ingest stopped; earlier transactions are kept\n"; return 1; }
+    if (columns.empty()) { std::cerr << "No rows for " << table << " in " << path << "\n"; return 1; }
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "Ingested " << inserted << " rows into " << table << " in " << std::fixed << std::setprecision(1) << secs << " s\n";
+    // Indexes are built once, after the load
+    TableSchema schema = read_table_schema(db, table);
+    return schema.shaCols.empty() ? 0 : build_sql_indexes(db, table, schema, {});
+}
+
+// ---- Backfill ----
+// Fills <column>_sha256 for existing rows, like addhash.py, but in rowid
+// ranges of --batch rows, each committed together with its checkpoint in
+// lookup_backfill. An interrupted run resumes after the last committed
+// range, and a later run only visits rows appended since; --verify starts
+// over but still rewrites only rows whose digest is missing or wrong.
+// NULL and empty values get a NULL digest, as in ingest; the sha256("")
+// addhash.py stores for them counts as correct and is left alone.
+
+// SQL truth value: the stored digest dig is current for the source value ref
+std::string digest_current_expr(const std::string& ref, const std::string& dig) {
+    return "(CASE WHEN " + ref + " IS NULL OR " + ref + " = '' THEN " + dig + " IS NULL OR " + dig + " = '" + kEmptySha256
+        + "' ELSE " + dig + " IS sha256_hex(" + ref + ") END)";
+}
+
+int backfill_table(sqlite3* db, const std::string& table, const std::vector<std::string>& hashCols, long long batchRows, bool verify) {
+    std::vector<std::string> all, cols;
+    sqlite3_stmt* st;
+    std::string sql = "PRAGMA table_info('" + table + "')";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    while (sqlite3_step(st) == SQLITE_ROW) all.push_back(reinterpret_cast<const char*>(sqlite3_column_text(st, 1)));
+    sqlite3_finalize(st);
+    if (all.empty()) { std::cerr << "No table " << table << "\n"; return 1; }
+    for (auto& c : all) {
+        bool wanted = hashCols.empty()
+            ? !ends_with_ci(c, "_sha256") && !ends_with_ci(c, "_sha") && c != "row_hashes"
+            : std::find(hashCols.begin(), hashCols.end(), c) != hashCols.end();
+        if (wanted) cols.push_back(c);
+    }
+    for (auto& h : hashCols)
+        if (std::find(all.begin(), all.end(), h) == all.end()) { std::cerr << "No column " << h << " in " << table << "\n"; return 1; }
+    if (cols.empty()) { std::cerr << "No columns to hash\n"; return 1; }
+
+    for (auto& c : cols)
+        if (std::find(all.begin(), all.end(), c + "_sha256") == all.end()
+            && !exec_sql(db, "ALTER TABLE \"" + table + "\" ADD COLUMN \"" + c + "_sha256\" BLOB"))
+            return 1;
+    if (!exec_sql(db, "CREATE TABLE IF NOT EXISTS lookup_backfill (tbl TEXT PRIMARY KEY, cols TEXT NOT NULL, last_rowid INTEGER NOT NULL)"))
+        return 1;
+
+    // Resume only if the checkpoint covers the same column set
+    std::string colList;
+    for (auto& c : cols) colList += (colList.empty() ? "" : ",") + c;
+    long long last = LLONG_MIN;
+    if (!verify && sqlite3_prepare_v2(db, "SELECT cols, last_rowid FROM lookup_backfill WHERE tbl = ?", -1, &st, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(st) == SQLITE_ROW && colList == reinterpret_cast<const char*>(sqlite3_column_text(st, 0)))
+            last = sqlite3_column_int64(st, 1);
+        sqlite3_finalize(st);
+    }
+    long long minRowid = 0, maxRowid = LLONG_MIN;
+    sql = "SELECT min(rowid), max(rowid) FROM '" + table + "'";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &st, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(st) == SQLITE_ROW && sqlite3_column_type(st, 0) != SQLITE_NULL) {
+            minRowid = sqlite3_column_int64(st, 0);
+            maxRowid = sqlite3_column_int64(st, 1);
+        }
+        sqlite3_finalize(st);
+    }
+    if (last != LLONG_MIN) std::cerr << "Resuming after rowid " << last << "\n";
+    else last = minRowid - 1;
+
+    // One statement per range; rows whose digests are all correct are left untouched
+    std::string set, stale;
+    for (auto& c : cols) {
+        std::string src = '"' + c + '"', dig = '"' + c + "_sha256\"";
+        std::string current = digest_current_expr(src, dig);
+        set += (set.empty() ? "" : ", ") + dig + " = CASE WHEN " + current + " THEN " + dig + " ELSE " + stored_digest_expr(src) + " END";
+        stale += (stale.empty() ? "NOT " : " OR NOT ") + current;
+    }
+    sqlite3_stmt* upd;
+    sqlite3_stmt* cp;
+    sql = "UPDATE \"" + table + "\" SET " + set + " WHERE rowid BETWEEN ? AND ? AND (" + stale + ")";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &upd, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO lookup_backfill (tbl, cols, last_rowid) VALUES (?, ?, ?)", -1, &cp, nullptr) != SQLITE_OK) {
+        std::cerr << sqlite3_errmsg(db) << "\n";
+        sqlite3_finalize(upd);
+        return 1;
+    }
+
+    long long updated = 0;
+    int rc = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    while (last < maxRowid) {
+        long long lo = last + 1;
+        long long hi = maxRowid - lo < batchRows ? maxRowid : lo + batchRows - 1;
+        if (!exec_sql(db, "BEGIN IMMEDIATE")) { rc = 1; break; }
+        sqlite3_bind_int64(upd, 1, lo);
+        sqlite3_bind_int64(upd, 2, hi);
+        bool ok = sqlite3_step(upd) == SQLITE_DONE;
+        sqlite3_reset(upd);
+        if (ok) updated += sqlite3_changes(db);
+        sqlite3_bind_text(cp, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(cp, 2, colList.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(cp, 3, hi);
+        ok = ok && sqlite3_step(cp) == SQLITE_DONE;
+        sqlite3_reset(cp);
+        if (!ok || !exec_sql(db, "COMMIT")) {
+            std::cerr << sqlite3_errmsg(db) << "\n";
+            exec_sql(db, "ROLLBACK");
+            rc = 1;
+            break;
+        }
+        last = hi;
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cerr << "\rChecked up to rowid " << last << " of " << maxRowid << ", " << updated << " rows updated ("
+            << std::fixed << std::setprecision(1) << secs << " s)" << std::flush;
+    }
+    sqlite3_finalize(upd);
+    sqlite3_finalize(cp);
+    std::cerr << "\n";
+    if (rc == 0) std::cout << "Backfilled " << cols.size() << " columns of " << table << "; " << updated << " rows updated\n";
+    return rc;
+}
+
+// ---- Reorganize ----
+// Moves every digest column and row_hashes out of the wide payload table
+// into <table>_digests, a WITHOUT ROWID (digest, rid) table of 32-byte
+// blobs. Lookups probe that narrow B-tree and join back to the payload
+// by rowid only for matches, so the hot pages hold nothing but digests.
+// Digests are sorted externally first and inserted in key order, which
+// appends to the B-tree instead of splitting pages at random.
+int reorganize_table(sqlite3* db, const std::string& table, const BuildOptions& opts = {}) {
+    TableSchema schema = read_table_schema(db, table);
+    std::vector<std::string> moved = schema.shaCols;
+    if (schema.hasJson) moved.push_back("row_hashes");
+    std::string dt = table + "_digests";
+    std::string ridIndex = "CREATE INDEX IF NOT EXISTS \"" + dt + "_rid\" ON \"" + dt + "\" (rid)";
+    if (moved.empty() && !schema.digestTable.empty()) {
+        // Already reorganized, possibly before the rid index existed
+        if (!exec_sql(db, ridIndex)) return 1;
+        std::cout << table << " is already reorganized into " << schema.digestTable << "\n";
+        return 0;
+    }
+    if (moved.empty()) { std::cerr << "No digest columns to move\n"; return 1; }
+
+    auto data_version = [&]() {
+        sqlite3_stmt* dv;
+        long long v = -1;
+        if (sqlite3_prepare_v2(db, "PRAGMA data_version", -1, &dv, nullptr) != SQLITE_OK) return v;
+        if (sqlite3_step(dv) == SQLITE_ROW) v = sqlite3_column_int64(dv, 0);
+        sqlite3_finalize(dv);
+        return v;
+    };
+    long long version = data_version();
+    TableSchema src = schema;
+    src.digestTable.clear();
+    const char* file = sqlite3_db_filename(db, "main");
+    SortedRuns<DigestRow> runs(run_directory(file ? file : "", opts));
+    bool ok = extract_sorted(db, src, table, opts, runs, [](long long rowid, const unsigned char* d) {
+        DigestRow r;
+        std::memcpy(r.digest, d, SHA256_DIGEST_LENGTH);
+        r.rowid = rowid;
+        return r;
+    });
+    if (!ok) return 1;
+
+    if (!exec_sql(db, "BEGIN IMMEDIATE")) return 1;
+    auto fail = [&]() { std::cerr << sqlite3_errmsg(db) << "\n"; exec_sql(db, "ROLLBACK"); return 1; };
+
+    if (!exec_sql(db, "CREATE TABLE IF NOT EXISTS \"" + dt + "\" (digest BLOB NOT NULL, rid INTEGER NOT NULL, "
+        "PRIMARY KEY (digest, rid)) WITHOUT ROWID"))
+        return fail();
+    // Another connection committing between the scan and the lock would be lost
+    if (data_version() != version) {
+        std::cerr << "Table changed during the scan; run reorganize again\n";
+        exec_sql(db, "ROLLBACK");
+        return 1;
+    }
+    sqlite3_stmt* ins;
+    std::string sql = "INSERT OR IGNORE INTO \"" + dt + "\" (digest, rid) VALUES (?, ?)";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &ins, nullptr) != SQLITE_OK) return fail();
+    long long copied = 0;
+    bool first = true;
+    DigestRow last;
+    MergeProgress progress(runs.total());
+    ok = runs.merge([&](const DigestRow& r) {
+        progress.step();
+        if (!first && r == last) return;
+        first = false;
+        last = r;
+        sqlite3_bind_blob(ins, 1, r.digest, SHA256_DIGEST_LENGTH, SQLITE_STATIC);
+        sqlite3_bind_int64(ins, 2, r.rowid);
+        if (sqlite3_step(ins) == SQLITE_DONE) copied += sqlite3_changes(db);
+        sqlite3_reset(ins);
+    });
+    progress.finish();
+    sqlite3_finalize(ins);
+    if (!ok) return fail();
+    // By row as well, for the triggers and for catching up on changed rows;
+    // built after the load, which arrives in digest order
+    if (!exec_sql(db, ridIndex)) return fail();
+
+    // Indexes on the moved columns must go before the columns can
+    std::vector<std::string> drop;
+    sqlite3_stmt* il;
+    sql = "SELECT il.name FROM pragma_index_list(?) il, pragma_index_info(il.name) ii "
+        "WHERE il.origin = 'c' AND ii.name = ?";
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &il, nullptr) != SQLITE_OK) return fail();
+    for (auto& col : moved) {
+        sqlite3_bind_text(il, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(il, 2, col.c_str(), -1, SQLITE_TRANSIENT);
+        while (sqlite3_step(il) == SQLITE_ROW) drop.push_back(reinterpret_cast<const char*>(sqlite3_column_text(il, 0)));
+        sqlite3_reset(il);
+    }
+    sqlite3_finalize(il);
+    std::sort(drop.begin(), drop.end());
+    drop.erase(std::unique(drop.begin(), drop.end()), drop.end());
+    for (auto& idx : drop)
+        if (!exec_sql(db, "DROP INDEX \"" + idx + "\"")) return fail();
+    for (auto& col : moved)
+        if (!exec_sql(db, "ALTER TABLE \"" + table + "\" DROP COLUMN \"" + col + "\"")) return fail();
+    if (!exec_sql(db, "COMMIT")) return fail();
+    std::cout << "Moved " << copied << " digests from " << moved.size() << " columns into " << dt
+        << "; run VACUUM to reclaim the freed pages\n";
+    return 0;
+}
+
+// ---- Warmup ----
+// Pulls the pages a lookup touches into the OS page cache, so the first
+// queries after a reboot or a file swap do not each wait on the disk.
+// The digest indexes and <table>_digests are walked level by level from
+// their root pages: each level is hinted to the kernel and read by parallel
+// workers, and the child page numbers of its interior pages make up the
+// next level. The -wal file and the side index files are read whole.
+
+struct WarmupOptions {
+    unsigned threads = 0;   // readers; 0 picks from the core count
+    bool rows = false;      // also the table's own B-tree, which verification reads
+    bool progress = true;   // report on stderr
+};
+
+// Read pages (sorted, 1-based) of a file with parallel workers, in runs of
+// consecutive pages of up to 4 MiB. visit(page, data) is called from the
+// workers for every page read.
+template <class Visit>
+bool read_page_runs(const std::string& path, long long pageSize, const std::vector<long long>& pages, unsigned workers,
+    std::atomic<uint64_t>& bytesRead, Visit&& visit) {
+    std::vector<std::pair<long long, long long>> runs;
+    long long maxRun = std::max<long long>(1, (4 << 20) / pageSize);
+    for (long long p : pages) {
+        if (!runs.empty() && runs.back().first + runs.back().second == p && runs.back().second < maxRun) ++runs.back().second;
+        else runs.push_back({ p, 1 });
+    }
+#ifdef POSIX_FADV_WILLNEED
+    // Start readahead of the whole level before the workers get to it
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        for (auto& r : runs) posix_fadvise(fd, (r.first - 1) * pageSize, r.second * pageSize, POSIX_FADV_WILLNEED);
+        ::close(fd);
+    }
+#endif
+    std::atomic<size_t> next{ 0 };
+    std::atomic<bool> ok{ true };
+    auto work = [&]() {
+        std::ifstream in(std::filesystem::u8path(path), std::ios::binary);
+        if (!in) { ok = false; return; }
+        std::vector<unsigned char> buf;
+        for (size_t i; (i = next++) < runs.size();) {
+            buf.resize(static_cast<size_t>(runs[i].second * pageSize));
+            in.seekg((runs[i].first - 1) * pageSize);
+            in.read(reinterpret_cast<char*>(buf.data()), static_cast<std::streamsize>(buf.size()));
+            long long got = in.gcount();
+            in.clear();
+            bytesRead += static_cast<uint64_t>(got);
+            for (long long k = 0; (k + 1) * pageSize <= got; ++k) visit(runs[i].first + k, buf.data() + k * pageSize);
+        }
+    };
+    workers = static_cast<unsigned>(std::min<size_t>(std::max(workers, 1u), runs.size()));
+    std::vector<std::thread> threads;
+    for (unsigned w = 1; w < workers; ++w) threads.emplace_back(work);
+    if (workers) work();
+    for (auto& t : threads) t.join();
+    return ok;
+}
+
+// Read every page of the B-trees rooted at roots; returns the page count.
+// Only interior pages are parsed: the right-most child pointer follows the
+// page header and every cell starts with its child's page number. Overflow
+// pages are not followed. Pages from the main file only, so in WAL mode a
+// few stale children may be read; that is harmless here.
+uint64_t warm_btrees(const std::string& path, long long pageSize, long long pageCount, std::vector<long long> level,
+    unsigned workers, std::atomic<uint64_t>& bytesRead) {
+    uint64_t total = 0;
+    std::mutex m;
+    for (int depth = 0; !level.empty() && depth < 64; ++depth) {
+        std::sort(level.begin(), level.end());
+        level.erase(std::unique(level.begin(), level.end()), level.end());
+        std::vector<long long> children;
+        read_page_runs(path, pageSize, level, workers, bytesRead, [&](long long page, const unsigned char* p) {
+            const unsigned char* h = p + (page == 1 ? 100 : 0);
+            if (h[0] != 0x02 && h[0] != 0x05) return;   // not an interior index or table page
+            unsigned cells = static_cast<unsigned>(h[3]) << 8 | h[4];
+            std::vector<long long> kids;
+            auto child = [&](const unsigned char* c) {
+                long long k = static_cast<long long>(c[0]) << 24 | c[1] << 16 | c[2] << 8 | c[3];
+                if (k >= 1 && k <= pageCount) kids.push_back(k);
+            };
+            child(h + 8);
+            for (unsigned c = 0; c < cells; ++c) {
+                long long ptr = (h - p) + 12 + 2 * c;
+                if (ptr + 2 > pageSize) break;
+                unsigned off = static_cast<unsigned>(p[ptr]) << 8 | p[ptr + 1];
+                if (off + 4 > pageSize) break;
+                child(p + off);
+            }
+            std::lock_guard<std::mutex> lock(m);
+            children.insert(children.end(), kids.begin(), kids.end());
+        });
+        total += level.size();
+        level.swap(children);
+    }
+    return total;
+}
+
+// Read a whole file in parallel 4 MiB pieces, if it exists
+bool warm_file(const std::string& path, unsigned workers, std::atomic<uint64_t>& bytesRead) {
+    std::error_code ec;
+    auto size = std::filesystem::file_size(std::filesystem::u8path(path), ec);
+    if (ec || size == 0) return false;
+    const long long kPiece = 4 << 20;
+    std::vector<long long> pieces;
+    for (long long i = 1; (i - 1) * kPiece < static_cast<long long>(size); ++i) pieces.push_back(i);
+    return read_page_runs(path, kPiece, pieces, workers, bytesRead, [](long long, const unsigned char*) {});
+}
+
+int warmup(sqlite3* db, const std::string& dbFile, const std::string& table, const WarmupOptions& opts) {
+    TableSchema schema = read_table_schema(db, table);
+    long long pageSize = 0, pageCount = 0;
+    sqlite3_stmt* st;
+    if (sqlite3_prepare_v2(db, "SELECT page_size, page_count FROM pragma_page_size, pragma_page_count", -1, &st, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(st) == SQLITE_ROW) {
+            pageSize = sqlite3_column_int64(st, 0);
+            pageCount = sqlite3_column_int64(st, 1);
+        }
+        sqlite3_finalize(st);
+    }
+    if (pageSize <= 0) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+
+    // Roots of the digest indexes, of <table>_digests and, with rows, of the table
+    std::vector<long long> roots;
+    std::vector<std::string> names;
+    std::string q = "SELECT m.name, m.type, m.tbl_name, m.rootpage, m.sql, "
+        "(SELECT name FROM pragma_index_info(m.name) WHERE seqno = 0) FROM sqlite_master m WHERE m.rootpage > 0";
+    if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        auto text = [&](int i) { auto* t = sqlite3_column_text(st, i); return t ? std::string(reinterpret_cast<const char*>(t)) : std::string(); };
+        std::string name = text(0), type = text(1), tbl = text(2), first = text(5), expr, where;
+        bool wanted = (!schema.digestTable.empty() && tbl == schema.digestTable)
+            || (type == "table" && tbl == table && opts.rows);
+        if (type == "index" && tbl == table) {
+            wanted = wanted || std::find(schema.indexedCols.begin(), schema.indexedCols.end(), first) != schema.indexedCols.end();
+            if (first.empty() && parse_index_sql(text(4), expr, where))
+                for (auto& e : schema.exprCols) wanted = wanted || e.expr == expr;
+        }
+        if (wanted) {
+            roots.push_back(sqlite3_column_int64(st, 3));
+            names.push_back(name);
+        }
+    }
+    sqlite3_finalize(st);
+
+    unsigned cores = std::thread::hardware_concurrency();
+    unsigned workers = opts.threads ? opts.threads : cores ? std::max(cores, 4u) : 4;
+    std::atomic<uint64_t> bytesRead{ 0 };
+    bool done = false, reported = false;
+    std::mutex m;
+    std::condition_variable cv;
+    auto t0 = std::chrono::steady_clock::now();
+    std::thread reporter;
+    if (opts.progress)
+        reporter = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(m);
+            while (!cv.wait_for(lock, std::chrono::milliseconds(200), [&] { return done; })) {
+                reported = true;
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                std::cerr << "\rWarming: " << (bytesRead >> 20) << " MiB, " << static_cast<uint64_t>((bytesRead >> 20) / std::max(secs, 0.001))
+                    << " MiB/s" << std::flush;
+            }
+        });
+    uint64_t pages = warm_btrees(dbFile, pageSize, pageCount, roots, workers, bytesRead);
+    int files = 0;
+    for (auto& f : { dbFile + "-wal", mphf_path(dbFile, table), prefix_index_path(dbFile, table), catalog_path(dbFile) })
+        files += warm_file(f, workers, bytesRead);
+    {
+        std::lock_guard<std::mutex> lock(m);
+        done = true;
+    }
+    cv.notify_all();
+    if (reporter.joinable()) reporter.join();
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    if (reported) std::cerr << "\n";
+    std::string list;
+    for (auto& n : names) list += (list.empty() ? "" : ", ") + n;
+    std::cout << "Warmed " << pages << " pages of " << (names.empty() ? std::string("no digest indexes") : list) << " and "
+        << files << " side files, " << (bytesRead >> 20) << " MiB in " << std::fixed << std::setprecision(2) << secs << " s\n";
+    return 0;
+}
+
+// JSON writing — Windows
+#ifdef _WIN32
+bool write_json_windows(const std::wstring& wpath, const std::vector<std::map<std::string, std::string>>& rows) {
+    std::string pathUtf8 = utf8_from_wide(wpath);
+    FILE* f = nullptr;
+    if (_wfopen_s(&f, wpath.c_str(), L"wb, ccs=UTF-8") || !f) {
+        std::cerr << "Cannot open " << pathUtf8 << "\n";
+        return false;
+    }
+    fputc('[', f);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        fputc('{', f);
+        bool first = true;
+        for (auto& kv : rows[i]) {
+            if (!first) fputc(',', f);
+            std::string ent = "\"" + json_escape(kv.first) + "\":\"" + json_escape(kv.second) + "\"";
+            fwrite(ent.c_str(), 1, ent.size(), f);
+            first = false;
+        }
+        fputc('}', f);
+        if (i + 1 < rows.size()) fputc(',', f);
+    }
+    fputc(']', f);
+    fclose(f);
+    std::cout << "Wrote " << pathUtf8 << "\n";
+    return true;
+}
+#endif
+
+// JSON writing — POSIX
+bool write_json_posix(const std::string& path, const std::vector<std::map<std::string, std::string>>& rows) {
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) { std::cerr << "Cannot open " << path << "\n"; return false; }
+    ofs << '[';
+    for (size_t i = 0; i < rows.size(); ++i) {
+        ofs << '{';
+        bool first = true;
+        for (auto& kv : rows[i]) {
+            if (!first) ofs << ',';
+            ofs << '"' << json_escape(kv.first) << "\":\"" << json_escape(kv.second) << '"';
+            first = false;
+        }
+        ofs << '}';
+        if (i + 1 < rows.size()) ofs << ',';
+    }
+    ofs << ']';
+    ofs.close();
+    std::cout << "Wrote " << path << "\n";
+    return true;
+}
+
+// One row as a JSON object, in the same shape as the JSON file output
+std::string row_json(const std::map<std::string, std::string>& row) {
+    std::string out = "{";
+    bool first = true;
+    for (auto& kv : row) {
+        if (!first) out += ',';
+        out += '"' + json_escape(kv.first) + "\":\"" + json_escape(kv.second) + '"';
+        first = false;
+    }
+    out += '}';
+    return out;
+}
+
+// ---- Shards ----
+// shard splits a table into n database files by the leading bits of one
+// digest column, so a hash or phone lookup only has to search one small
+// file. Readers scan rowid ranges in parallel on their own connections and
+// hand rows to one writer thread per shard. A manifest, <name>.shards,
+// names the files; passing it in place of the database makes lookups and
+// the coordinator route by digest.
+
+// Shard owning a digest: its leading 32 bits scaled to the shard count,
+// which is the leading log2(n) bits when n is a power of two
+size_t shard_of(const unsigned char* digest, size_t shards) {
+    uint64_t lead = uint64_t(digest[0]) << 24 | uint64_t(digest[1]) << 16 | uint64_t(digest[2]) << 8 | digest[3];
+    return static_cast<size_t>((lead * shards) >> 32);
+}
+
+struct ShardManifest {
+    std::string table;
+    std::string key;                    // digest column the rows were split on
+    std::vector<std::string> routed;    // lookup modes that match that column
+    std::vector<std::string> files;     // shard i, relative to the manifest
+};
+
+// Routing by the key column is only exact when no other column, row_hashes,
+// expression index or digest table can match a lookup: rows matching there
+// were placed by a different digest
+bool single_digest_source(const TableSchema& schema, const std::string& key) {
+    return schema.shaCols.size() == 1 && schema.shaCols[0] == key && !schema.hasJson && schema.exprCols.empty()
+        && schema.digestTable.empty();
+}
+
+// Shards a lookup has to visit: the owners of its digests for routed
+// modes, all of them otherwise. Rows with an empty or missing key may sit
+// in shard 0 or with sha256(""), so the empty digest goes everywhere.
+std::vector<size_t> owning_shards(const std::vector<std::string>& routed, size_t shards, const std::string& mode, const std::string& query) {
+    std::vector<size_t> targets;
+    if (std::find(routed.begin(), routed.end(), mode) == routed.end()) {
+        for (size_t s = 0; s < shards; ++s) targets.push_back(s);
+        return targets;
+    }
+    std::vector<std::string> hashes = mode == "phone" ? phone_hashes(query) : std::vector<std::string>{ sha256_hex(query) };
+    if (has_empty_digest(hashes)) return owning_shards({}, shards, mode, query);
+    unsigned char d[SHA256_DIGEST_LENGTH];
+    for (auto& h : hashes)
+        if (parse_hex_digest(h.c_str(), h.size(), d)) targets.push_back(shard_of(d, shards));
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    return targets;
+}
+
+// False, quietly, for anything that is not a manifest (e.g. a database).
+// Routes are dropped unless the first shard still has the key column as
+// its only digest source, so a later schema change cannot lose rows.
+bool load_shard_manifest(const std::string& path, ShardManifest& out) {
+    std::ifstream in(std::filesystem::u8path(path), std::ios::binary);
+    char magic[16] = {};
+    if (!in.read(magic, 15) || std::string(magic) != "lookup-shards\t1") return false;
+    auto dir = std::filesystem::u8path(path).parent_path();
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos) continue;
+        std::string tag = line.substr(0, tab), val = line.substr(tab + 1);
+        if (tag == "table") out.table = val;
+        else if (tag == "key") out.key = val;
+        else if (tag == "route") out.routed = split_list(val);
+        else if (tag == "shard") out.files.push_back((dir / std::filesystem::u8path(val)).u8string());
+    }
+    if (out.files.empty()) return false;
+    sqlite3* db;
+    if (!out.routed.empty() && open_database(out.files[0], SQLITE_OPEN_READONLY, &db)) {
+        if (!single_digest_source(read_table_schema(db, out.table), out.key)) out.routed.clear();
+        sqlite3_close(db);
+    }
+    else out.routed.clear();
+    return true;
+}
+
+int shard_table(sqlite3* db, const std::string& dbFile, const std::string& table, long long shards, const std::string& key,
+    const std::string& outDir, const BuildOptions& opts) {
+    if (shards < 2 || shards > 4096) { std::cerr << "Shard count must be between 2 and 4096\n"; return 1; }
+    TableSchema schema = read_table_schema(db, table);
+    if (std::find(schema.shaCols.begin(), schema.shaCols.end(), key) == schema.shaCols.end()) {
+        std::cerr << "No digest column " << key << " in " << table << "; pass --key <column>_sha256\n";
+        return 1;
+    }
+
+    // The table's own DDL and indexes are replayed in every shard
+    std::string create;
+    std::vector<std::string> indexes;
+    sqlite3_stmt* st;
+    if (sqlite3_prepare_v2(db, "SELECT type, sql FROM sqlite_master WHERE tbl_name = ? AND sql IS NOT NULL AND type IN ('table', 'index')",
+        -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+    while (sqlite3_step(st) == SQLITE_ROW) {
+        std::string sql = reinterpret_cast<const char*>(sqlite3_column_text(st, 1));
+        if (std::strcmp(reinterpret_cast<const char*>(sqlite3_column_text(st, 0)), "table") == 0) create = sql;
+        else indexes.push_back(sql);
+    }
+    sqlite3_finalize(st);
+    if (create.empty()) { std::cerr << "No table " << table << "\n"; return 1; }
+    // Generated columns are recomputed by each shard
+    std::vector<std::string> cols;
+    std::string pr = "PRAGMA table_xinfo('" + table + "')";
+    if (sqlite3_prepare_v2(db, pr.c_str(), -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    while (sqlite3_step(st) == SQLITE_ROW)
+        if (sqlite3_column_int(st, 6) == 0) cols.push_back(reinterpret_cast<const char*>(sqlite3_column_text(st, 1)));
+    sqlite3_finalize(st);
+    std::string select = "SELECT \"" + key + "\"", insert = "INSERT INTO \"" + table + "\" (", params;
+    for (size_t i = 0; i < cols.size(); ++i) {
+        select += ", \"" + cols[i] + '"';
+        insert += (i ? ", \"" : "\"") + cols[i] + '"';
+        params += i ? ",?" : "?";
+    }
+    insert += ") VALUES (" + params + ")";
+
+    auto src = std::filesystem::u8path(dbFile);
+    auto dir = outDir.empty() ? src.parent_path() : std::filesystem::u8path(outDir);
+    std::string stem = src.stem().u8string();
+    std::vector<std::string> names, paths;
+    for (long long s = 0; s < shards; ++s) {
+        names.push_back(stem + "-" + std::to_string(s) + ".db");
+        paths.push_back((dir / std::filesystem::u8path(names.back())).u8string());
+        std::error_code ec;
+        if (std::filesystem::exists(std::filesystem::u8path(paths.back()), ec)) {
+            std::cerr << paths.back() << " already exists; remove old shards first\n";
+            return 1;
+        }
+    }
+
+    // Per-shard queues of flattened rows, bounded so fast readers wait for
+    // the writers
+    struct Shard {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<std::vector<sqlite3_value*>> queue;
+        bool closed = false;
+        long long rows = 0;
+        std::string error;
+    };
+    const size_t kBatchRows = 1024, kQueued = 8;
+    std::vector<std::unique_ptr<Shard>> out;
+    for (long long s = 0; s < shards; ++s) out.emplace_back(new Shard);
+    auto free_batch = [](std::vector<sqlite3_value*>& b) {
+        for (auto* v : b) sqlite3_value_free(v);
+        b.clear();
+    };
+
+    // Each shard is a new file: load it unjournaled, then build its indexes.
+    // After an error the writer keeps draining its queue so readers finish.
+    auto writer = [&](size_t s) {
+        trace_thread_name("shard writer " + std::to_string(s));
+        TraceSpan trace("write shard", paths[s]);
+        Shard& sh = *out[s];
+        sqlite3* sdb = nullptr;
+        sqlite3_stmt* ins = nullptr;
+        bool ok = open_database(paths[s], SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, &sdb);
+        if (ok) {
+            exec_sql(sdb, "PRAGMA journal_mode=OFF");
+            exec_sql(sdb, "PRAGMA synchronous=OFF");
+            ok = exec_sql(sdb, create) && sqlite3_prepare_v2(sdb, insert.c_str(), -1, &ins, nullptr) == SQLITE_OK && exec_sql(sdb, "BEGIN");
+        }
+        long long rows = 0;
+        std::unique_lock<std::mutex> lock(sh.m);
+        for (;;) {
+            sh.cv.wait(lock, [&] { return sh.closed || !sh.queue.empty(); });
+            if (sh.queue.empty()) break;
+            auto batch = std::move(sh.queue.front());
+            sh.queue.pop_front();
+            sh.cv.notify_all();
+            lock.unlock();
+            for (size_t r = 0; ok && r < batch.size(); r += cols.size()) {
+                for (size_t c = 0; c < cols.size(); ++c) sqlite3_bind_value(ins, static_cast<int>(c + 1), batch[r + c]);
+                ok = sqlite3_step(ins) == SQLITE_DONE;
+                sqlite3_reset(ins);
+                if (ok && ++rows % 100000 == 0) ok = exec_sql(sdb, "COMMIT") && exec_sql(sdb, "BEGIN");
+            }
+            free_batch(batch);
+            lock.lock();
+        }
+        lock.unlock();
+        sqlite3_finalize(ins);
+        ok = ok && exec_sql(sdb, "COMMIT");
+        for (auto& idx : indexes) ok = ok && exec_sql(sdb, idx);
+        std::lock_guard<std::mutex> guard(sh.m);
+        sh.rows = rows;
+        if (!ok) sh.error = sdb ? sqlite3_errmsg(sdb) : "Cannot create " + paths[s];
+        if (sdb) sqlite3_close(sdb);
+    };
+
+    long long lo = 0, hi = -1;
+    std::string q = "SELECT min(rowid), max(rowid) FROM \"" + table + "\"";
+    if (sqlite3_prepare_v2(db, q.c_str(), -1, &st, nullptr) != SQLITE_OK) { std::cerr << sqlite3_errmsg(db) << "\n"; return 1; }
+    if (sqlite3_step(st) == SQLITE_ROW && sqlite3_column_type(st, 0) != SQLITE_NULL) {
+        lo = sqlite3_column_int64(st, 0);
+        hi = sqlite3_column_int64(st, 1);
+    }
+    sqlite3_finalize(st);
+    unsigned cores = std::thread::hardware_concurrency();
+    unsigned workers = opts.threads ? opts.threads : cores ? cores : 1;
+    unsigned long long span = hi < lo ? 1 : static_cast<unsigned long long>(hi - lo) / workers + 1;
+
+    std::atomic<long long> copied{ 0 }, unkeyed{ 0 };
+    std::atomic<unsigned> running{ workers };
+    std::atomic<bool> failed{ false };
+    auto reader = [&](unsigned w) {
+        trace_thread_name("shard reader " + std::to_string(w));
+        sqlite3* conn = db;
+        sqlite3_stmt* rs = nullptr;
+        long long a = lo + static_cast<long long>(span * w);
+        long long b = w + 1 == workers ? hi : a + static_cast<long long>(span) - 1;
+        TraceSpan trace("read rows", "rowids " + std::to_string(a) + ".." + std::to_string(b));
+        std::string sql = select + " FROM \"" + table + "\" WHERE rowid BETWEEN ? AND ?";
+        if ((w > 0 && !open_database(dbFile, SQLITE_OPEN_READONLY, &conn))
+            || sqlite3_prepare_v2(conn, sql.c_str(), -1, &rs, nullptr) != SQLITE_OK) {
+            if (conn) std::cerr << sqlite3_errmsg(conn) << "\n";
+            failed = true;
+        }
+        std::vector<std::vector<sqlite3_value*>> pending(static_cast<size_t>(shards));
+        auto push = [&](size_t s) {
+            Shard& sh = *out[s];
+            std::unique_lock<std::mutex> lock(sh.m);
+            sh.cv.wait(lock, [&] { return sh.queue.size() < kQueued; });
+            sh.queue.push_back(std::move(pending[s]));
+            sh.cv.notify_all();
+            pending[s] = {};
+        };
+        int rc = SQLITE_DONE;
+        if (rs) {
+            sqlite3_bind_int64(rs, 1, a);
+            sqlite3_bind_int64(rs, 2, b);
+            long long n = 0;
+            unsigned char d[SHA256_DIGEST_LENGTH];
+            while (!failed && (rc = sqlite3_step(rs)) == SQLITE_ROW) {
+                // Rows without a valid key digest go to shard 0
+                bool keyed = false;
+                if (sqlite3_column_type(rs, 0) == SQLITE_BLOB && sqlite3_column_bytes(rs, 0) == SHA256_DIGEST_LENGTH) {
+                    std::memcpy(d, sqlite3_column_blob(rs, 0), SHA256_DIGEST_LENGTH);
+                    keyed = true;
+                }
+                else if (sqlite3_column_type(rs, 0) == SQLITE_TEXT)
+                    keyed = parse_hex_digest(reinterpret_cast<const char*>(sqlite3_column_text(rs, 0)), static_cast<size_t>(sqlite3_column_bytes(rs, 0)), d);
+                size_t s = keyed ? shard_of(d, static_cast<size_t>(shards)) : 0;
+                if (!keyed) ++unkeyed;
+                for (size_t c = 0; c < cols.size(); ++c) pending[s].push_back(sqlite3_value_dup(sqlite3_column_value(rs, static_cast<int>(c + 1))));
+                if (pending[s].size() >= kBatchRows * cols.size()) push(s);
+                if ((++n & 4095) == 0) copied += 4096;
+            }
+            copied += n & 4095;
+            if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                std::cerr << sqlite3_errmsg(conn) << "\n";
+                failed = true;
+            }
+        }
+        for (size_t s = 0; s < pending.size(); ++s)
+            if (!pending[s].empty()) push(s);
+        sqlite3_finalize(rs);
+        if (conn && conn != db) sqlite3_close(conn);
+        --running;
+    };
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (long long s = 0; s < shards; ++s) threads.emplace_back(writer, static_cast<size_t>(s));
+    std::vector<std::thread> readers;
+    for (unsigned w = 0; w < workers; ++w) readers.emplace_back(reader, w);
+    while (running > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cerr << "\rCopying: " << copied << " rows, " << static_cast<long long>(copied / std::max(secs, 0.001)) << "/s" << std::flush;
+    }
+    for (auto& t : readers) t.join();
+    std::cerr << "\rCopied " << copied << " rows; indexing shards\n";
+    for (auto& sh : out) {
+        std::lock_guard<std::mutex> lock(sh->m);
+        sh->closed = true;
+        sh->cv.notify_all();
+    }
+    for (auto& t : threads) t.join();
+
+    for (size_t s = 0; s < out.size(); ++s)
+        if (!out[s]->error.empty()) {
+            std::cerr << paths[s] << ": " << out[s]->error << "\n";
+            failed = true;
+        }
+    std::string manifest = (dir / std::filesystem::u8path(stem + ".shards")).u8string();
+    if (!failed) {
+        std::string tmp = manifest + ".tmp";
+        std::ofstream mf(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        mf << "lookup-shards\t1\n";
+        mf << "table\t" << table << "\n";
+        mf << "key\t" << key << "\n";
+        if (single_digest_source(schema, key))
+            mf << "route\t" << (to_lower(key).find("phone") != std::string::npos ? "phone" : "hash") << "\n";
+        for (auto& n : names) mf << "shard\t" << n << "\n";
+        mf.close();
+        std::error_code ec;
+        std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(manifest), ec);
+        if (!mf || ec) { std::cerr << "Cannot write " << manifest << "\n"; failed = true; }
+    }
+    if (failed) {
+        // Leave nothing half-written behind, so the split can simply be rerun
+        std::error_code ec;
+        for (auto& p : paths) std::filesystem::remove(std::filesystem::u8path(p), ec);
+        return 1;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    for (size_t s = 0; s < out.size(); ++s) std::cout << names[s] << ": " << out[s]->rows << " rows\n";
+    if (unkeyed) std::cout << unkeyed << " rows without a " << key << " digest were put in " << names[0] << "\n";
+    if (!single_digest_source(schema, key))
+        std::cout << table << " has digests outside " << key << ", so lookups will search every shard\n";
+    std::cout << "Split " << table << " into " << shards << " shards by " << key << " in " << std::fixed << std::setprecision(1)
+        << secs << " s; manifest " << manifest << "\n";
+    return 0;
+}
+
+// ---- Engine ----
+// The lookup path as a library. An Engine opens a database file, or a
+// shard manifest, once and answers lookups from any number of threads,
+// each on a pooled read-only connection. The schema and side indexes are
+// reloaded whenever the file's stamp changes, so a long-lived engine sees
+// rebuilt indexes and never uses stale ones. lookup_engine.h wraps it in a
+// C API; the command-line lookups go through it too.
+
+class Engine {
+public:
+    Engine() = default;
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+    ~Engine() {
+        for (sqlite3* db : idle_) sqlite3_close(db);
+    }
+
+    // False, with error set, when the file or the table cannot be opened
+    bool open(const std::string& path, const std::string& table) {
+        table_ = table;
+        ShardManifest manifest;
+        if (load_shard_manifest(path, manifest)) {
+            if (manifest.table != table) { error = path + " shards table " + manifest.table + ", not " + table; return false; }
+            routed_ = manifest.routed;
+            for (auto& f : manifest.files) {
+                shards_.emplace_back(new Engine);
+                if (!shards_.back()->open(f, table)) { error = shards_.back()->error; return false; }
+            }
+            return true;
+        }
+        dbFile_ = path;
+        sqlite3* db = acquire();
+        if (!db) { error = "Cannot open " + path; return false; }
+        sqlite3_stmt* st;
+        bool found = sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type IN ('table', 'view') AND name = ?", -1, &st, nullptr) == SQLITE_OK;
+        if (found) {
+            sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+            found = sqlite3_step(st) == SQLITE_ROW;
+            sqlite3_finalize(st);
+        }
+        release(db);
+        if (!found) error = "No table " + table + " in " + path;
+        return found;
+    }
+
+    // Pass each matching row to sink until it returns false. Returns the
+    // number of rows passed, or LOOKUP_ERR_MODE / LOOKUP_ERR_DATABASE.
+    int lookup(const std::string& mode, const std::string& query, const std::function<bool(const std::map<std::string, std::string>&)>& sink,
+        const std::vector<std::string>& columns = {}) {
+        if (mode != "phone" && mode != "address" && mode != "hash") return LOOKUP_ERR_MODE;
+        int delivered = 0;
+        if (!shards_.empty()) {
+            // Routed modes visit only the shards owning the query's digests
+            bool more = true;
+            for (size_t s : owning_shards(routed_, shards_.size(), mode, query)) {
+                int n = shards_[s]->lookup(mode, query, [&](const std::map<std::string, std::string>& r) { return more = sink(r); }, columns);
+                if (n < 0) return n;
+                delivered += n;
+                if (!more) break;
+            }
+            return delivered;
+        }
+        TraceSpan trace("lookup", mode + " in " + dbFile_);
+        sqlite3* db = acquire();
+        if (!db) return LOOKUP_ERR_DATABASE;
+        // The schema check, index probe and row fetch share one snapshot.
+        // BEGIN is deferred, so read once to pin the snapshot before the
+        // file stamp is compared with the side indexes.
+        if (!quiet_exec(db, "BEGIN") || !quiet_exec(db, "SELECT 1 FROM sqlite_master LIMIT 1")) {
+            sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+            release(db);
+            return LOOKUP_ERR_DATABASE;
+        }
+        auto snap = snapshot(db);
+        LookupOptions opts;
+        opts.columns = columns;
+        if (mode != "address" && snap->hasMphf) opts.indexes.mphf = &snap->mphf;
+        else if (mode != "address" && snap->hasPrefix) opts.indexes.prefix = &snap->prefix;
+        std::vector<std::map<std::string, std::string>> rows;
+        LOOKUP_PROBE2(query__start, mode.c_str(), query.c_str());
+        if (mode == "phone") rows = lookup_by_phone(db, snap->schema, table_, query, opts);
+        else if (mode == "address") rows = lookup_by_address(db, snap->schema, table_, query, opts);
+        else rows = lookup_by_hash(db, snap->schema, table_, query, opts);
+        LOOKUP_PROBE2(query__done, mode.c_str(), static_cast<int64_t>(rows.size()));
+        // A pooled connection must not be left inside the transaction
+        if (!quiet_exec(db, "COMMIT")) sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        release(db);
+        for (auto& r : rows) {
+            ++delivered;
+            if (!sink(r)) break;
+        }
+        return delivered;
+    }
+
+    // Side index files the last lookups ignored because they are stale, one
+    // line each; lookups stay correct without them but take the SQL path.
+    // The last failed transaction statement follows, if any.
+    std::string warnings() {
+        std::string out;
+        for (auto& s : shards_) out += s->warnings();
+        std::lock_guard<std::mutex> lock(m_);
+        if (snap_ && !snap_->stale.empty()) out += "Ignoring stale index " + snap_->stale + "\n";
+        if (!failed_.empty()) out += failed_ + "\n";
+        return out;
+    }
+
+    std::string error;
+
+private:
+    // What depends on the file's contents, swapped as a whole when it changes
+    struct Snapshot {
+        FileStamp stamp;
+        TableSchema schema;
+        MphfIndex mphf;
+        PrefixIndex prefix;
+        bool hasMphf = false, hasPrefix = false;
+        std::string stale;                      // path of a side index left out as stale
+    };
+
+    // Loaded without holding m_, so lookups on the current snapshot never
+    // wait for a reload; concurrent reloads of the same stamp are harmless
+    std::shared_ptr<const Snapshot> snapshot(sqlite3* db) {
+        FileStamp stamp = read_file_stamp(dbFile_);
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if (snap_ && snap_->stamp == stamp) return snap_;
+        }
+        auto snap = std::make_shared<Snapshot>();
+        snap->stamp = stamp;
+        snap->schema = get_table_schema(db, dbFile_, table_);
+        TraceSpan trace("side indexes");
+        std::string mphfFile = mphf_path(dbFile_, table_), prefixFile = prefix_index_path(dbFile_, table_);
+        snap->hasMphf = snap->mphf.open(mphfFile, stamp);
+        if (!snap->hasMphf) snap->hasPrefix = snap->prefix.open(prefixFile, stamp);
+        if (snap->mphf.stale()) snap->stale = mphfFile;
+        else if (snap->prefix.stale()) snap->stale = prefixFile;
+        std::lock_guard<std::mutex> lock(m_);
+        snap_ = snap;
+        return snap;
+    }
+
+    // Engines are embedded, so nothing is printed: a failure is kept for
+    // warnings(), where lookups on other threads cannot race on error
+    bool quiet_exec(sqlite3* db, const char* sql) {
+        char* msg = nullptr;
+        if (sqlite3_exec(db, sql, nullptr, nullptr, &msg) == SQLITE_OK) return true;
+        std::string line = std::string(sql) + " failed: " + (msg ? msg : sqlite3_errmsg(db));
+        sqlite3_free(msg);
+        std::lock_guard<std::mutex> lock(m_);
+        failed_ = line;
+        return false;
+    }
+
+    sqlite3* acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            if (!idle_.empty()) {
+                sqlite3* db = idle_.back();
+                idle_.pop_back();
+                return db;
+            }
+        }
+        sqlite3* db;
+        return open_database(dbFile_, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, &db) ? db : nullptr;
+    }
+
+    void release(sqlite3* db) {
+        std::lock_guard<std::mutex> lock(m_);
+        idle_.push_back(db);
+    }
+
+    std::string dbFile_, table_;
+    std::mutex m_;                              // guards snap_, idle_ and failed_
+    std::shared_ptr<const Snapshot> snap_;
+    std::string failed_;                        // last transaction statement that failed
+    std::vector<sqlite3*> idle_;                // pooled connections, one per concurrent lookup
+    std::vector<std::string> routed_;
+    std::vector<std::unique_ptr<Engine>> shards_;   // set when opened from a manifest
+};
+
+struct lookup_engine {
+    Engine engine;
+};
+
+extern "C" {
+
+lookup_engine* lookup_engine_open(const char* path, const char* table, char* err, size_t err_size) {
+    std::unique_ptr<lookup_engine> e(new lookup_engine);
+    if (e->engine.open(path, table)) return e.release();
+    if (err && err_size) {
+        size_t n = std::min(err_size - 1, e->engine.error.size());
+        std::memcpy(err, e->engine.error.data(), n);
+        err[n] = '\0';
+    }
+    return nullptr;
+}
+
+int lookup_engine_lookup(lookup_engine* engine, const char* mode, const char* query, const char* columns,
+    lookup_row_fn sink, void* ctx) {
+    std::vector<const char*> names, values;
+    return engine->engine.lookup(mode, query, [&](const std::map<std::string, std::string>& r) {
+        names.clear();
+        values.clear();
+        for (auto& kv : r) {
+            names.push_back(kv.first.c_str());
+            values.push_back(kv.second.c_str());
+        }
+        return sink(ctx, static_cast<int>(r.size()), names.data(), values.data()) != 0;
+    }, columns ? split_list(columns) : std::vector<std::string>());
+}
+
+size_t lookup_engine_warnings(lookup_engine* engine, char* buf, size_t size) {
+    std::string w = engine->engine.warnings();
+    if (buf && size) {
+        size_t n = std::min(size - 1, w.size());
+        std::memcpy(buf, w.data(), n);
+        buf[n] = '\0';
+    }
+    return w.size();
+}
+
+void lookup_engine_close(lookup_engine* engine) { delete engine; }
+
+}
+
+// ---- Server mode ----
+// Keeps the database open and answers lookups over a Unix domain socket.
+// Requests are lines "<mode>\t<query>"; each response is one JSON object
+// per matching row, one per line, terminated by an empty line.
+// "reload" or "reload\t<path>" swaps in a rebuilt database file; on Linux
+// a file renamed over the served path is picked up by inotify as well.
+#ifndef _WIN32
+
+// Everything tied to one database file. Clients hold a shared_ptr while
+// they use it, so a swapped-out generation lives until its last in-flight
+// query finishes; its cuckoo writer exits once it is retired.
+struct ServerGeneration {
+    std::string dbFile;
+    TableSchema schema;
+    dev_t dev = 0;
+    ino_t ino = 0;
+    DigestCuckoo cuckoo;
+    std::shared_ptr<const FileStamp> cuckooCovers;   // file state the cuckoo has caught up with; std::atomic_load/store
+    std::atomic<bool> cuckooReady{ false };
+    std::atomic<bool> cuckooFailed{ false };
+    std::atomic<bool> retired{ false };
+};
+
+// Binary protocol. A client that opens with the 8 bytes "LKUPBIN1" sends
+// length-prefixed frames instead of text lines; integers are little-endian.
+//   request:  u32 size | u32 id | u8 op | u8 0 | u16 n | n x 32-byte digest
+//   response: u32 size | u32 id | u8 status | for each digest: u32 count,
+//             then count x i64 rowid (op 1) or count x (u32 len | JSON row) (op 2)
+// size counts the bytes after itself; status 1 carries an error message.
+// Requests from all binary clients run on one worker pool and are answered
+// as they finish, so responses come back in any order, matched by id.
+// lookup_client.h implements the client side.
+const char kBinaryHello[] = "LKUPBIN1";
+const uint8_t kOpRowids = 1, kOpRows = 2;
+const size_t kMaxInFlight = 1024;   // per connection, before the reader stops reading
+
+struct BinaryConn {
+    int fd = -1;
+    std::mutex writeMutex;          // one response written at a time
+    std::atomic<bool> broken{ false };
+    std::mutex m;                   // guards inFlight; the reader never waits on a write
+    std::condition_variable cv;
+    size_t inFlight = 0;
+};
+
+struct BinaryTask {
+    std::shared_ptr<BinaryConn> conn;
+    uint32_t id = 0;
+    uint8_t op = 0;
+    std::string digests;            // n x 32 bytes
+};
+
+// One execution of a lookup, shared by every identical request that
+// arrives while it runs
+struct Flight {
+    std::mutex m;
+    std::condition_variable cv;
+    std::shared_ptr<const std::string> response;   // set once, then read-only
+};
+
+struct ServerState {
+    std::string table;
+    std::filesystem::path dataDir;                // reload only serves files from here
+    std::shared_ptr<ServerGeneration> current;   // accessed with std::atomic_load/store
+    std::atomic<bool> reloading{ false };         // one reload at a time
+    std::mutex flightsMutex;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights;   // by request_key
+    std::mutex taskMutex;                                  // binary protocol work queue
+    std::condition_variable taskCv;
+    std::deque<BinaryTask> tasks;
+    std::once_flag workersStarted;
+};
+
+// Single writer: fill the cuckoo index, then catch up whenever another
+// connection (addhash.py, a backfill) commits to the database. With a
+// change log only the changed rows are re-read, otherwise the table is
+// rescanned. Entries of deleted rows stay behind; hits are verified anyway.
+// The file stamp is read before each check and published once the index
+// holds everything committed up to it: requests whose snapshot has the
+// same stamp may trust an absent digest, all others fall back to SQL.
+void cuckoo_writer(std::shared_ptr<ServerGeneration> gen, std::string table) {
+    trace_thread_name("cuckoo writer");
+    sqlite3* db;
+    if (!open_database(gen->dbFile, SQLITE_OPEN_READONLY, &db)) {
+        std::cerr << "Cuckoo index disabled\n";
+        gen->cuckooFailed = true;
+        return;
+    }
+    sqlite3_stmt* dv;
+    sqlite3_prepare_v2(db, "PRAGMA data_version;", -1, &dv, nullptr);
+    long long version = -1, logPos = -1;
+    auto insert = [&](long long rowid, const unsigned char* d) { gen->cuckoo.insert(DigestCuckoo::key_of(d), rowid); };
+    while (!gen->retired.load(std::memory_order_relaxed)) {
+        FileStamp stamp = read_file_stamp(gen->dbFile);
+        long long v = sqlite3_step(dv) == SQLITE_ROW ? sqlite3_column_int64(dv, 0) : version;
+        sqlite3_reset(dv);
+        bool current = v == version;
+        if (!current) {
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<long long> rowids;
+            long long upto;
+            if (logPos >= 0 && changed_rowids(db, table, logPos, rowids, upto)) {
+                current = for_each_digest_of(db, gen->schema, table, rowids, insert);
+                if (current) logPos = upto;
+            }
+            else {
+                logPos = change_log_position(db, table);
+                current = for_each_digest(db, gen->schema, table, insert);
+            }
+            // A failed pass is retried in full
+            if (current) version = v;
+            else logPos = -1;
+            if (current && !gen->cuckooReady.load(std::memory_order_relaxed)) {
+                auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+                std::cout << "Cuckoo index ready: " << gen->cuckoo.size() << " digests in " << ms << " ms" << std::endl;
+            }
+        }
+        // Without a commit since the last pass, a new stamp (a checkpoint) is covered too
+        auto covers = std::atomic_load(&gen->cuckooCovers);
+        if (current && (!covers || !(*covers == stamp))) std::atomic_store(&gen->cuckooCovers, std::make_shared<const FileStamp>(stamp));
+        if (current) gen->cuckooReady.store(true, std::memory_order_release);
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    sqlite3_finalize(dv);
+    sqlite3_close(db);
+}
+
+// The cuckoo, if it may answer for the calling connection's read
+// transaction: it must have caught up with the file as it is now, which is
+// no older than that snapshot. Call after the transaction has read.
+const DigestCuckoo* current_cuckoo(ServerGeneration* gen) {
+    if (!gen->cuckooReady.load(std::memory_order_acquire)) return nullptr;
+    auto covers = std::atomic_load(&gen->cuckooCovers);
+    return covers && *covers == read_file_stamp(gen->dbFile) ? &gen->cuckoo : nullptr;
+}
+
+// Open a database file as a new generation, start its cuckoo writer and
+// warm its pages
+std::shared_ptr<ServerGeneration> open_generation(const std::string& dbFile, const std::string& table) {
+    auto gen = std::make_shared<ServerGeneration>();
+    gen->dbFile = dbFile;
+    struct stat sb;
+    if (stat(dbFile.c_str(), &sb) != 0) { std::cerr << "Cannot stat " << dbFile << "\n"; return nullptr; }
+    gen->dev = sb.st_dev;
+    gen->ino = sb.st_ino;
+    sqlite3* db;
+    if (!open_database(dbFile, SQLITE_OPEN_READONLY, &db)) return nullptr;
+    gen->schema = get_table_schema(db, dbFile, table);
+    std::thread(cuckoo_writer, gen, table).detach();
+    // Read the digest indexes in while the cuckoo index fills, so the
+    // first SQL fallback after a swap does not go to disk
+    WarmupOptions warm;
+    warm.progress = false;
+    warmup(db, dbFile, table, warm);
+    sqlite3_close(db);
+    return gen;
+}
+
+// Build the new generation in the background, wait until its index is
+// warm, then publish it. Queries keep running on the old generation.
+void reload_database(ServerState* st, std::string dbFile) {
+    auto t0 = std::chrono::steady_clock::now();
+    auto gen = open_generation(dbFile, st->table);
+    if (gen) {
+        while (!gen->cuckooReady && !gen->cuckooFailed) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto old = std::atomic_exchange(&st->current, gen);
+        old->retired = true;
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "Reloaded " << dbFile << " in " << ms << " ms" << std::endl;
+    }
+    else std::cerr << "Reload of " << dbFile << " failed; still serving the previous file\n";
+    st->reloading = false;
+}
+
+// Start a reload unless one is already running
+bool start_reload(ServerState* st, const std::string& dbFile) {
+    bool idle = false;
+    if (!st->reloading.compare_exchange_strong(idle, true)) return false;
+    std::thread(reload_database, st, dbFile).detach();
+    return true;
+}
+
+#ifdef __linux__
+// Reload when a new file is renamed over (or written to) the served path.
+// Writes into the same file keep its inode and are ignored.
+void watch_database(ServerState* st) {
+    auto path = std::filesystem::u8path(std::atomic_load(&st->current)->dbFile);
+    std::string dir = path.has_parent_path() ? path.parent_path().u8string() : ".";
+    std::string name = path.filename().u8string();
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+        std::cerr << "inotify unavailable; use the reload command\n";
+        if (fd >= 0) close(fd);
+        return;
+    }
+    alignas(inotify_event) char buf[4096];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        bool hit = false;
+        for (char* p = buf; p < buf + n; p += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(p)->len) {
+            auto* ev = reinterpret_cast<inotify_event*>(p);
+            if (ev->len && name == ev->name) hit = true;
+        }
+        if (!hit) continue;
+        auto cur = std::atomic_load(&st->current);
+        struct stat sb;
+        if (stat(cur->dbFile.c_str(), &sb) != 0 || (sb.st_dev == cur->dev && sb.st_ino == cur->ino)) continue;
+        start_reload(st, cur->dbFile);
+    }
+    close(fd);
+}
+#endif
+
+// Directory a database file resolves to, following symlinks
+std::filesystem::path database_directory(const std::string& dbFile) {
+    std::error_code ec;
+    auto p = std::filesystem::weakly_canonical(std::filesystem::absolute(std::filesystem::u8path(dbFile), ec), ec);
+    return ec ? std::filesystem::path() : p.parent_path();
+}
+
+std::string handle_request(ServerState* st, ServerGeneration* gen, sqlite3* db, const std::string& line) {
+    if (line == "reload" || line.rfind("reload\t", 0) == 0) {
+        std::string path = line.size() > 7 ? line.substr(7) : gen->dbFile;
+        // Anyone who can connect may ask; only files next to the served one are opened
+        if (st->dataDir.empty() || database_directory(path) != st->dataDir) return "{\"error\":\"reload is limited to files in the served database's directory\"}\n\n";
+        if (!start_reload(st, path)) return "{\"error\":\"reload in progress\"}\n\n";
+        return "{\"reloading\":\"" + json_escape(path) + "\"}\n\n";
+    }
+    if (line == "metrics") return metrics_text() + "\n";
+    auto tab = line.find('\t');
+    if (tab == std::string::npos) return "{\"error\":\"expected <mode>\\t<query>\"}\n\n";
+    std::string mode = line.substr(0, tab), query = line.substr(tab + 1);
+    LookupOptions opts;
+    std::vector<std::map<std::string, std::string>> rows;
+    if (mode != "phone" && mode != "address" && mode != "hash") return "{\"error\":\"unknown mode\"}\n\n";
+    // One read transaction per request: the index probe, verification and
+    // SQL fallback all see the same snapshot, even while a writer commits.
+    // The snapshot is pinned first, then the cuckoo is used only if it has
+    // caught up with at least that snapshot.
+    {
+        TraceSpan trace("lookup", mode);
+        exec_sql(db, "BEGIN");
+        exec_sql(db, "SELECT 1 FROM sqlite_master LIMIT 1");
+        opts.indexes.cuckoo = current_cuckoo(gen);
+        LOOKUP_PROBE2(query__start, mode.c_str(), query.c_str());
+        if (mode == "phone") rows = lookup_by_phone(db, gen->schema, st->table, query, opts);
+        else if (mode == "address") rows = lookup_by_address(db, gen->schema, st->table, query, opts);
+        else rows = lookup_by_hash(db, gen->schema, st->table, query, opts);
+        LOOKUP_PROBE2(query__done, mode.c_str(), static_cast<int64_t>(rows.size()));
+        exec_sql(db, "COMMIT");
+    }
+    TraceSpan trace("serialize", std::to_string(rows.size()) + " rows");
+    std::string out;
+    for (auto& r : rows) out += row_json(r) + '\n';
+    out += '\n';
+    return out;
+}
+
+// Fill a Unix socket address; false if the path does not fit
+bool unix_address(const std::string& path, sockaddr_un& addr) {
+    addr = sockaddr_un{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+// Listening socket at path, replacing a stale one; -1 after reporting why
+int listen_unix(const std::string& socketPath) {
+    sockaddr_un addr;
+    if (!unix_address(socketPath, addr)) { std::cerr << "Socket path too long\n"; return -1; }
+    int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (lfd < 0) { std::cerr << "socket: " << std::strerror(errno) << "\n"; return -1; }
+    unlink(socketPath.c_str());
+    if (bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(lfd, 128) != 0) {
+        std::cerr << "Cannot listen on " << socketPath << ": " << std::strerror(errno) << "\n";
+        close(lfd);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return lfd;
+}
+
+// Connected socket to a server, or -1
+int connect_unix(const std::string& socketPath) {
+    sockaddr_un addr;
+    if (!unix_address(socketPath, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Identity of a lookup for coalescing: the generation (file) plus the mode
+// and the query as the lookup sees it. Empty for anything else.
+std::string request_key(const ServerGeneration* gen, const std::string& line) {
+    auto tab = line.find('\t');
+    if (tab == std::string::npos) return std::string();
+    std::string mode = line.substr(0, tab), query = line.substr(tab + 1), norm;
+    if (mode == "hash") norm = query;
+    else if (mode == "address") norm = to_lower(query);
+    else if (mode == "phone") {
+        auto hashes = phone_hashes(query);
+        std::sort(hashes.begin(), hashes.end());
+        for (auto& h : hashes) norm += h;
+    }
+    else return std::string();
+    return std::to_string(reinterpret_cast<uintptr_t>(gen)) + '\t' + mode + '\t' + norm;
+}
+
+// Run a request, or wait for an identical one already running and share
+// its response buffer; shared tells which happened
+std::shared_ptr<const std::string> coalesced_request(ServerState* st, ServerGeneration* gen, sqlite3* db, const std::string& line, bool& shared) {
+    std::string key = request_key(gen, line);
+    shared = false;
+    if (key.empty()) return std::make_shared<const std::string>(handle_request(st, gen, db, line));
+    std::shared_ptr<Flight> flight;
+    bool leader = false;
+    {
+        std::lock_guard<std::mutex> lock(st->flightsMutex);
+        auto& slot = st->flights[key];
+        if (!slot) {
+            slot = std::make_shared<Flight>();
+            leader = true;
+        }
+        flight = slot;
+    }
+    shared = !leader;
+    if (shared) LOOKUP_PROBE1(cache__hit, "coalesce");
+    else LOOKUP_PROBE1(cache__miss, "coalesce");
+    if (!leader) {
+        TraceSpan trace("wait for identical lookup");
+        std::unique_lock<std::mutex> lock(flight->m);
+        flight->cv.wait(lock, [&] { return flight->response != nullptr; });
+        return flight->response;
+    }
+    auto response = std::make_shared<const std::string>(handle_request(st, gen, db, line));
+    {
+        // Later arrivals start a new flight and see a newer snapshot
+        std::lock_guard<std::mutex> lock(st->flightsMutex);
+        st->flights.erase(key);
+    }
+    std::lock_guard<std::mutex> lock(flight->m);
+    flight->response = response;
+    flight->cv.notify_all();
+    return response;
+}
+
+bool send_all(int fd, const char* p, size_t n) {
+    while (n) {
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= static_cast<size_t>(w);
+    }
+    return true;
+}
+
+void put_u32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+uint32_t get_u32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; --i) v = v << 8 | static_cast<unsigned char>(p[i]);
+    return v;
+}
+
+std::string binary_frame(uint32_t id, uint8_t status, const std::string& body) {
+    std::string out;
+    put_u32(out, static_cast<uint32_t>(body.size() + 5));
+    put_u32(out, id);
+    out.push_back(static_cast<char>(status));
+    return out + body;
+}
+
+// Look up every digest of a task in one read transaction; found counts the rows
+std::string binary_response(ServerState* st, ServerGeneration* gen, sqlite3* db, const BinaryTask& task, uint64_t& found) {
+    found = 0;
+    if (task.op != kOpRowids && task.op != kOpRows) return binary_frame(task.id, 1, "unknown op");
+    LookupOptions opts;
+    if (task.op == kOpRowids) opts.columns = { "rowid" };
+    TraceSpan trace("lookup", "binary, " + std::to_string(task.digests.size() / SHA256_DIGEST_LENGTH) + " digests");
+    std::string body;
+    exec_sql(db, "BEGIN");
+    exec_sql(db, "SELECT 1 FROM sqlite_master LIMIT 1");
+    opts.indexes.cuckoo = current_cuckoo(gen);
+    LOOKUP_PROBE2(query__start, "binary", "");
+    for (size_t k = 0; k + SHA256_DIGEST_LENGTH <= task.digests.size(); k += SHA256_DIGEST_LENGTH) {
+        std::string hex = to_hex(reinterpret_cast<const unsigned char*>(task.digests.data() + k), SHA256_DIGEST_LENGTH);
+        auto rows = lookup_by_digest(db, gen->schema, st->table, hex, opts);
+        found += rows.size();
+        if (task.op == kOpRowids) {
+            // A row matching through several columns is listed once
+            std::vector<long long> rowids;
+            for (auto& r : rows) rowids.push_back(std::atoll(r["rowid"].c_str()));
+            std::sort(rowids.begin(), rowids.end());
+            rowids.erase(std::unique(rowids.begin(), rowids.end()), rowids.end());
+            put_u32(body, static_cast<uint32_t>(rowids.size()));
+            for (long long r : rowids) {
+                put_u32(body, static_cast<uint32_t>(static_cast<uint64_t>(r)));
+                put_u32(body, static_cast<uint32_t>(static_cast<uint64_t>(r) >> 32));
+            }
+        }
+        else {
+            put_u32(body, static_cast<uint32_t>(rows.size()));
+            for (auto& r : rows) {
+                std::string json = row_json(r);
+                put_u32(body, static_cast<uint32_t>(json.size()));
+                body += json;
+            }
+        }
+    }
+    LOOKUP_PROBE2(query__done, "binary", static_cast<int64_t>(found));
+    exec_sql(db, "COMMIT");
+    return binary_frame(task.id, 0, body);
+}
+
+// Pool thread with its own connection, which follows the current generation
+void binary_worker(ServerState* st) {
+    trace_thread_name("binary worker");
+    std::shared_ptr<ServerGeneration> gen;
+    sqlite3* db = nullptr;
+    for (;;) {
+        BinaryTask task;
+        {
+            std::unique_lock<std::mutex> lock(st->taskMutex);
+            while (st->tasks.empty())
+                if (!st->taskCv.wait_for(lock, std::chrono::seconds(1), [&] { return !st->tasks.empty(); }) && gen && gen->retired) {
+                    sqlite3_close(db);
+                    db = nullptr;
+                    gen.reset();
+                }
+            task = std::move(st->tasks.front());
+            st->tasks.pop_front();
+        }
+        auto cur = std::atomic_load(&st->current);
+        if (cur != gen) {
+            if (db) sqlite3_close(db);
+            db = nullptr;
+            gen.reset();
+            if (open_database(cur->dbFile, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, &db)) gen = cur;
+        }
+        // Once a client has gone away, drain its queue without looking anything up
+        if (!task.conn->broken) {
+            auto t0 = std::chrono::steady_clock::now();
+            uint64_t found = 0;
+            std::string frame = db ? binary_response(st, gen.get(), db, task, found) : binary_frame(task.id, 1, "cannot open database");
+            record_request(kMetricBinary, std::chrono::steady_clock::now() - t0, found, frame.size(), frame[8] != 0, false);
+            std::lock_guard<std::mutex> lock(task.conn->writeMutex);
+            TraceSpan trace("write", std::to_string(frame.size()) + " bytes");
+            LOOKUP_PROBE1(output__flush, static_cast<int64_t>(frame.size()));
+            if (!send_all(task.conn->fd, frame.data(), frame.size())) task.conn->broken = true;
+        }
+        std::lock_guard<std::mutex> lock(task.conn->m);
+        --task.conn->inFlight;
+        task.conn->cv.notify_all();
+    }
+}
+
+// Read frames from a binary client and queue them for the pool; buf holds
+// whatever arrived after the hello
+void serve_binary(ServerState* st, int fd, std::string buf) {
+    std::call_once(st->workersStarted, [st]() {
+        unsigned cores = std::thread::hardware_concurrency();
+        for (unsigned i = 0; i < (cores ? cores : 4); ++i) std::thread(binary_worker, st).detach();
+    });
+    auto conn = std::make_shared<BinaryConn>();
+    conn->fd = fd;
+    char chunk[65536];
+    bool ok = true;
+    while (ok) {
+        // Whole frames: header, then n digests
+        size_t start = 0;
+        while (ok && buf.size() - start >= 12) {
+            uint32_t size = get_u32(buf.data() + start);
+            size_t n = static_cast<unsigned char>(buf[start + 10]) | static_cast<size_t>(static_cast<unsigned char>(buf[start + 11])) << 8;
+            if (size != 8 + n * SHA256_DIGEST_LENGTH) { ok = false; break; }
+            if (buf.size() - start < 4 + size) break;
+            BinaryTask task;
+            task.conn = conn;
+            task.id = get_u32(buf.data() + start + 4);
+            task.op = static_cast<uint8_t>(buf[start + 8]);
+            task.digests = buf.substr(start + 12, n * SHA256_DIGEST_LENGTH);
+            start += 4 + size;
+            {
+                std::unique_lock<std::mutex> lock(conn->m);
+                conn->cv.wait(lock, [&] { return conn->inFlight < kMaxInFlight; });
+                ok = !conn->broken;
+                ++conn->inFlight;
+            }
+            std::lock_guard<std::mutex> lock(st->taskMutex);
+            st->tasks.push_back(std::move(task));
+            st->taskCv.notify_one();
+        }
+        buf.erase(0, start);
+        if (!ok) break;
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, static_cast<size_t>(n));
+    }
+    // Answer what was queued before closing
+    std::unique_lock<std::mutex> lock(conn->m);
+    conn->cv.wait(lock, [&] { return conn->inFlight == 0; });
+    close(fd);
+}
+
+#ifdef __linux__
+// Shared-memory results for clients on the same host. A client that opens
+// with "LKUPSHM1" receives a memfd and an eventfd over SCM_RIGHTS, then
+// sends text requests as usual. Each response is written into the ring
+// the memfd maps. Only a 16-byte descriptor, u64 offset | u64 length,
+// crosses the socket. The client reads the response in place and releases
+// it by advancing tail. It signals the eventfd only when the server waits
+// for space. A response larger than the ring is sent inline after a
+// descriptor with offset ~0. lookup_client.h has the matching client.
+const char kShmHello[] = "LKUPSHM1";
+const size_t kShmRingBytes = size_t(64) << 20;
+const size_t kShmDataOffset = 4096;             // the first page holds ShmRingHeader
+
+struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head;       // end of the last response written
+    alignas(64) std::atomic<uint64_t> tail;       // end of the last response released
+    alignas(64) std::atomic<uint32_t> waiting;    // the server is blocked on the eventfd
+};
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring header is shared between processes");
+
+class ResultRing {
+public:
+    ResultRing() = default;
+    ResultRing(const ResultRing&) = delete;
+    ResultRing& operator=(const ResultRing&) = delete;
+    ~ResultRing() {
+        if (base_) munmap(base_, kShmDataOffset + kShmRingBytes);
+        if (memfd_ >= 0) close(memfd_);
+        if (efd_ >= 0) close(efd_);
+    }
+
+    bool active() const { return base_ != nullptr; }
+
+    // Create the ring and hand its memfd and eventfd to the client
+    bool open(int sock) {
+        memfd_ = memfd_create("lookup-results", MFD_CLOEXEC);
+        efd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (memfd_ < 0 || efd_ < 0 || ftruncate(memfd_, static_cast<off_t>(kShmDataOffset + kShmRingBytes)) != 0) return false;
+        void* p = mmap(nullptr, kShmDataOffset + kShmRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+        if (p == MAP_FAILED) return false;
+        base_ = static_cast<char*>(p);
+        hdr_ = new (base_) ShmRingHeader();
+        uint64_t size = kShmRingBytes;
+        iovec iov{ &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+        int fds[2] = { memfd_, efd_ };
+        std::memcpy(CMSG_DATA(c), fds, sizeof(fds));
+        return sendmsg(sock, &msg, MSG_NOSIGNAL) == static_cast<ssize_t>(sizeof(size));
+    }
+
+    // Copy a response into the ring and send its descriptor. Responses are
+    // kept contiguous, skipping the end of the ring when they would wrap.
+    bool send(int sock, const std::string& resp) {
+        uint64_t desc[2] = { ~uint64_t(0), resp.size() };
+        if (resp.size() > kShmRingBytes)
+            return send_all(sock, reinterpret_cast<const char*>(desc), sizeof(desc)) && send_all(sock, resp.data(), resp.size());
+        uint64_t pos = head_ % kShmRingBytes;
+        uint64_t start = kShmRingBytes - pos < resp.size() ? head_ + (kShmRingBytes - pos) : head_;
+        while (start + resp.size() - hdr_->tail.load(std::memory_order_acquire) > kShmRingBytes) {
+            // Announce the wait, then re-check, so a release in between is not missed
+            hdr_->waiting.store(1);
+            if (start + resp.size() - hdr_->tail.load() <= kShmRingBytes) break;
+            pollfd pfd[2] = { { efd_, POLLIN, 0 }, { sock, POLLRDHUP, 0 } };
+            if (poll(pfd, 2, 1000) < 0 && errno != EINTR) return false;
+            if (pfd[1].revents & (POLLRDHUP | POLLHUP | POLLERR)) return false;
+            uint64_t v;
+            if (pfd[0].revents & POLLIN) while (read(efd_, &v, sizeof(v)) < 0 && errno == EINTR) {}
+        }
+        hdr_->waiting.store(0, std::memory_order_relaxed);
+        std::memcpy(base_ + kShmDataOffset + start % kShmRingBytes, resp.data(), resp.size());
+        head_ = start + resp.size();
+        hdr_->head.store(head_, std::memory_order_release);
+        desc[0] = start;
+        return send_all(sock, reinterpret_cast<const char*>(desc), sizeof(desc));
+    }
+
+private:
+    int memfd_ = -1, efd_ = -1;
+    char* base_ = nullptr;
+    ShmRingHeader* hdr_ = nullptr;
+    uint64_t head_ = 0;
+};
+#endif
+
+// One thread and one read-only connection per client. The connection
+// follows the current generation between requests; an idle client lets
+// go of a retired one within a second so it can be freed.
+void serve_client(ServerState* st, int fd) {
+    trace_thread_name("client " + std::to_string(fd));
+    std::shared_ptr<ServerGeneration> gen;
+    sqlite3* db = nullptr;
+    auto detach = [&]() {
+        if (db) sqlite3_close(db);
+        db = nullptr;
+        gen.reset();
+    };
+    std::string buf;
+    char chunk[65536];
+    bool ok = true, text = false;
+#ifdef __linux__
+    ResultRing ring;
+#endif
+    while (ok) {
+        pollfd pfd{ fd, POLLIN, 0 };
+        int pr = poll(&pfd, 1, 1000);
+        if (pr < 0 && errno != EINTR) break;
+        if (pr <= 0) {
+            if (gen && gen->retired) detach();
+            continue;
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, static_cast<size_t>(n));
+        // Binary and shared-memory clients say hello first; text requests
+        // never start with either
+        const size_t hello = sizeof(kBinaryHello) - 1;
+        if (!text && buf.compare(0, hello, kBinaryHello, std::min(hello, buf.size())) == 0) {
+            if (buf.size() < hello) continue;
+            detach();
+            serve_binary(st, fd, buf.substr(hello));
+            return;
+        }
+#ifdef __linux__
+        if (!text && buf.compare(0, hello, kShmHello, std::min(hello, buf.size())) == 0) {
+            if (buf.size() < hello) continue;
+            if (!ring.open(fd)) break;
+            buf.erase(0, hello);
+        }
+#endif
+        text = true;
+        size_t start = 0, nl;
+        while (ok && (nl = buf.find('\n', start)) != std::string::npos) {
+            std::string line = buf.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            auto cur = std::atomic_load(&st->current);
+            if (cur != gen) {
+                detach();
+                if (!open_database(cur->dbFile, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, &db)) { ok = false; break; }
+                gen = cur;
+            }
+            auto t0 = std::chrono::steady_clock::now();
+            bool shared;
+            auto resp = coalesced_request(st, gen.get(), db, line, shared);
+            MetricMode mm = metric_mode(line.substr(0, line.find('\t')));
+            if (mm != kMetricModes) {
+                // One row per line before the terminating empty line
+                bool error = resp->compare(0, 9, "{\"error\":") == 0;
+                uint64_t rows = error ? 0 : static_cast<uint64_t>(std::count(resp->begin(), resp->end(), '\n')) - 1;
+                record_request(mm, std::chrono::steady_clock::now() - t0, rows, resp->size(), error, shared);
+            }
+            TraceSpan trace("write", std::to_string(resp->size()) + " bytes");
+            LOOKUP_PROBE1(output__flush, static_cast<int64_t>(resp->size()));
+#ifdef __linux__
+            if (ring.active()) {
+                ok = ring.send(fd, *resp);
+                continue;
+            }
+#endif
+            ok = send_all(fd, resp->data(), resp->size());
+        }
+        buf.erase(0, start);
+    }
+    detach();
+    close(fd);
+}
+
+// Rewrite a Prometheus textfile (e.g. for node_exporter) every few seconds
+void dump_metrics(std::string path) {
+    for (;;) {
+        std::string tmp = path + ".tmp";
+        std::ofstream out(std::filesystem::u8path(tmp), std::ios::binary | std::ios::trunc);
+        out << metrics_text();
+        out.close();
+        std::error_code ec;
+        if (out) std::filesystem::rename(std::filesystem::u8path(tmp), std::filesystem::u8path(path), ec);
+        if (!out || ec) std::cerr << "Cannot write " << path << "\n";
+        std::this_thread::sleep_for(std::chrono::seconds(10));
+    }
+}
+
+int serve(const std::string& dbFile, const std::string& table, const std::string& socketPath, const std::string& metricsFile) {
+    // Shared with detached threads for the life of the process
+    auto* st = new ServerState;
+    st->table = table;
+    st->dataDir = database_directory(dbFile);
+    auto gen = open_generation(dbFile, table);
+    if (!gen) return 1;
+    std::atomic_store(&st->current, gen);
+
+    int lfd = listen_unix(socketPath);
+    if (lfd < 0) return 1;
+#ifdef __linux__
+    std::thread(watch_database, st).detach();
+#endif
+    if (!metricsFile.empty()) std::thread(dump_metrics, metricsFile).detach();
+    std::cout << "Serving " << table << " on " << socketPath << std::endl;
+    for (;;) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+            std::cerr << "accept: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        std::thread(serve_client, st, fd).detach();
+    }
+}
+#endif
+
+// ---- Coordinator ----
+// Fronts several servers, each serving one shard of a table split by the
+// leading bits of a digest. Lookups whose digests are known up front go
+// only to the owning shards; everything else, including address searches
+// and reload requests, goes to all shards in parallel. Rows are streamed
+// to the client as shards answer; a shard that fails or misses the
+// deadline adds an error object before the terminating empty line.
+#ifndef _WIN32
+// Pooled connections to one shard server
+class ShardPool {
+public:
+    explicit ShardPool(std::string socketPath) : path(std::move(socketPath)) {}
+    ~ShardPool() { for (int fd : idle_) close(fd); }
+
+    // An idle connection, or a new one; -1 if the shard is unreachable
+    int acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            while (!idle_.empty()) {
+                int fd = idle_.back();
+                idle_.pop_back();
+                // Readable while idle means the shard closed it (restart, reload)
+                pollfd pfd{ fd, POLLIN, 0 };
+                if (poll(&pfd, 1, 0) == 0) return fd;
+                close(fd);
+            }
+        }
+        return connect_unix(path);
+    }
+
+    // Return a connection whose last response was read completely
+    void release(int fd) {
+        std::lock_guard<std::mutex> lock(m_);
+        idle_.push_back(fd);
+    }
+
+    const std::string path;
+
+private:
+    std::mutex m_;
+    std::vector<int> idle_;
+};
+
+struct CoordinatorState {
+    std::string table;
+    std::vector<std::unique_ptr<ShardPool>> shards;
+    std::vector<std::string> routed;   // modes sent only to the owning shards; none by default
+    int timeoutMs = 1000;
+};
+
+// Shards a request line goes to; lines without a query go to all
+std::vector<size_t> request_shards(const CoordinatorState* cs, const std::string& line) {
+    auto tab = line.find('\t');
+    if (tab == std::string::npos) return owning_shards({}, cs->shards.size(), line, "");
+    return owning_shards(cs->routed, cs->shards.size(), line.substr(0, tab), line.substr(tab + 1));
+}
+
+// Scatter one request line and stream the merged answer to the client;
+// false once the client is gone
+bool coordinate_request(CoordinatorState* cs, int fd, const std::string& line) {
+    struct Pending {
+        size_t shard;
+        int fd;
+        std::string buf;
+        bool done = false;
+    };
+    std::string errors;
+    auto shard_error = [&](size_t s, const char* what) {
+        errors += "{\"error\":\"shard " + std::string(what) + "\",\"shard\":\"" + json_escape(cs->shards[s]->path) + "\"}\n";
+    };
+    std::vector<Pending> pending;
+    std::string req = line + '\n';
+    for (size_t s : request_shards(cs, line)) {
+        int sfd = cs->shards[s]->acquire();
+        if (sfd >= 0 && send_all(sfd, req.data(), req.size())) pending.push_back({ s, sfd, {} });
+        else {
+            if (sfd >= 0) close(sfd);
+            shard_error(s, "unavailable");
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(cs->timeoutMs);
+    size_t open = pending.size();
+    bool ok = true;
+    char chunk[65536];
+    std::vector<pollfd> pfds;
+    std::vector<size_t> which;
+    while (ok && open) {
+        pfds.clear();
+        which.clear();
+        for (size_t i = 0; i < pending.size(); ++i)
+            if (!pending[i].done) {
+                pfds.push_back({ pending[i].fd, POLLIN, 0 });
+                which.push_back(i);
+            }
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        int pr = poll(pfds.data(), pfds.size(), static_cast<int>(std::max<long long>(left, 0)));
+        if (pr < 0 && errno == EINTR) continue;
+        if (pr <= 0) break;
+        std::string out;
+        for (size_t k = 0; k < pfds.size(); ++k) {
+            if (!pfds[k].revents) continue;
+            Pending& p = pending[which[k]];
+            ssize_t n = recv(p.fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                close(p.fd);
+                p.done = true;
+                --open;
+                shard_error(p.shard, "closed the connection");
+                continue;
+            }
+            p.buf.append(chunk, static_cast<size_t>(n));
+            // Forward complete rows; an empty line ends this shard's answer
+            size_t start = 0, nl;
+            while ((nl = p.buf.find('\n', start)) != std::string::npos) {
+                if (nl == start) { p.done = true; break; }
+                out.append(p.buf, start, nl - start + 1);
+                start = nl + 1;
+            }
+            if (!p.done) { p.buf.erase(0, start); continue; }
+            --open;
+            if (nl + 1 == p.buf.size()) cs->shards[p.shard]->release(p.fd);
+            else {
+                close(p.fd);
+                shard_error(p.shard, "sent more than one response");
+            }
+        }
+        ok = out.empty() || send_all(fd, out.data(), out.size());
+    }
+    for (auto& p : pending)
+        if (!p.done) {
+            close(p.fd);
+            shard_error(p.shard, "timed out");
+        }
+    errors += '\n';
+    return ok && send_all(fd, errors.data(), errors.size());
+}
+
+void coordinator_client(CoordinatorState* cs, int fd) {
+    std::string buf;
+    char chunk[65536];
+    bool ok = true;
+    while (ok) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, static_cast<size_t>(n));
+        size_t start = 0, nl;
+        while (ok && (nl = buf.find('\n', start)) != std::string::npos) {
+            std::string line = buf.substr(start, nl - start);
+            start = nl + 1;
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            ok = coordinate_request(cs, fd, line);
+        }
+        buf.erase(0, start);
+    }
+    close(fd);
+}
+
+int coordinate(const std::string& table, const std::string& socketPath, const std::vector<std::string>& shards,
+    const std::vector<std::string>& routed, int timeoutMs) {
+    if (shards.empty()) { std::cerr << "No shards; pass --shards a.sock,b.sock\n"; return 1; }
+    for (auto& r : routed)
+        if (r != "hash" && r != "phone") { std::cerr << "Only hash and phone lookups can be routed, not " << r << "\n"; return 1; }
+    // Shared with detached threads for the life of the process
+    auto* cs = new CoordinatorState;
+    cs->table = table;
+    cs->routed = routed;
+    cs->timeoutMs = timeoutMs;
+    for (auto& s : shards) cs->shards.emplace_back(new ShardPool(s));
+
+    int lfd = listen_unix(socketPath);
+    if (lfd < 0) return 1;
+    std::cout << "Coordinating " << table << " across " << shards.size() << " shards on " << socketPath << std::endl;
+    for (;;) {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) continue;
+            std::cerr << "accept: " << std::strerror(errno) << "\n";
+            return 1;
+        }
+        std::thread(coordinator_client, cs, fd).detach();
+    }
+}
+#endif
+
+// Lookup results as a JSON file under static/, or as text on stdout
+void print_rows(const std::vector<std::map<std::string, std::string>>& rows, const std::string& query, bool jsonOut) {
+    TraceSpan trace("write", std::to_string(rows.size()) + " rows");
+    if (jsonOut) {
+#ifdef _WIN32
+        CreateDirectoryW(L"static", nullptr);
+        int wlen = MultiByteToWideChar(CP_UTF8, 0, query.c_str(), -1, nullptr, 0);
+        std::wstring wq(wlen, L'\0');
+        MultiByteToWideChar(CP_UTF8, 0, query.c_str(), -1, &wq[0], wlen);
+        // sanitize
+        std::wstring safe;
+        for (wchar_t c : wq) safe += (iswalnum(c) || c == L' ' || c == L'_') ? c : L'_';
+        std::wstring wpath = L"static\\" + safe + L".json";
+        write_json_windows(wpath, rows);
+#else
+        mkdir("static", 0755);
+        std::string safe;
+        for (unsigned char c : query) safe += isalnum(c) ? c : '_';
+        std::string path = "static/" + safe + ".json";
+        write_json_posix(path, rows);
+#endif
+    }
+    else {
+        for (auto& r : rows) {
+            std::cout << "---- Row ----\n";
+            for (auto& kv : r) std::cout << kv.first << ": " << kv.second << "\n";
+        }
+    }
+}
+
+// main logic
+int run(int argc, char** argv) {
+    std::setlocale(LC_ALL, "");
+    if (argc < 4) {
+        std::cerr << "Usage:<exe> <db> <table> <mode> [--json] [--columns a,b] <query>\n"
+            << "      <exe> <db> <table> build-index mphf|sql [--cover a,b]\n"
+            << "      <exe> <db> <table> build-index prefix [--memory MB] [--tmp dir] [--threads n] [--full]\n"
+            << "      <exe> <db> <table> build-index expr --source a,b\n"
+            << "      <exe> <db> <table> reorganize [--memory MB] [--tmp dir] [--threads n]\n"
+            << "      <exe> <db> <table> pack-row-hashes\n"
+            << "      <exe> <db> <table> backfill [--hash a,b] [--batch rows] [--verify]\n"
+            << "      <exe> <db> <table> install-triggers [--hash a,b]\n"
+            << "      <exe> <db> <table> ingest <file.csv|file.sql> [--hash a,b] [--threads n] [--batch rows]\n"
+            << "      <exe> <db> <table> warmup [--threads n] [--rows]\n"
+            << "      <exe> <db> <table> serve <socket-path> [--metrics file.prom]\n"
+            << "      <exe> <db|-> <table> coordinate <socket-path> --shards a.sock,b.sock [--route hash,phone] [--timeout ms]\n"
+            << "      <exe> <db> <table> shard <n> --key <column> [--out dir] [--threads n]\n"
+            << "      (a .shards manifest can stand in for <db> in lookups and coordinate)\n"
+            << "      (--trace file.json records a Chrome trace of any command)\n";
+        return 1;
+    }
+    int i = 1;
+    const char* dbFile = argv[i++];
+    std::string table = argv[i++];
+    std::string mode = argv[i++];
+    bool jsonOut = false;
+    bool verify = false;
+    bool hasQuery = false;
+    std::string query;
+    std::vector<std::string> columns, cover, sources, shards, routed;
+    std::string shardKey, outDir, metricsFile, traceFile;
+    int timeoutMs = 1000;
+    IngestOptions ingest;
+    BuildOptions build;
+    WarmupOptions warm;
+    for (; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--json") jsonOut = true;
+        else if (arg == "--verify") verify = true;
+        else if (arg == "--full") build.full = true;
+        else if (arg == "--rows") warm.rows = true;
+        else if (arg == "--columns" && i + 1 < argc) columns = split_list(argv[++i]);
+        else if (arg == "--cover" && i + 1 < argc) cover = split_list(argv[++i]);
+        else if (arg == "--source" && i + 1 < argc) sources = split_list(argv[++i]);
+        else if (arg == "--shards" && i + 1 < argc) shards = split_list(argv[++i]);
+        else if (arg == "--route" && i + 1 < argc) routed = split_list(argv[++i]);
+        else if (arg == "--key" && i + 1 < argc) shardKey = argv[++i];
+        else if (arg == "--out" && i + 1 < argc) outDir = argv[++i];
+        else if (arg == "--metrics" && i + 1 < argc) metricsFile = argv[++i];
+        else if (arg == "--trace" && i + 1 < argc) traceFile = argv[++i];
+        else if (arg == "--timeout" && i + 1 < argc) timeoutMs = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--hash" && i + 1 < argc) ingest.hashCols = split_list(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc) ingest.threads = build.threads = warm.threads = static_cast<unsigned>(std::strtoul(argv[++i], nullptr, 10));
+        else if (arg == "--memory" && i + 1 < argc) build.memoryBytes = std::max<size_t>(1, std::strtoull(argv[++i], nullptr, 10)) << 20;
+        else if (arg == "--tmp" && i + 1 < argc) build.tmpDir = argv[++i];
+        else if (arg == "--batch" && i + 1 < argc) ingest.txRows = std::max(1LL, std::atoll(argv[++i]));
+        else if (!hasQuery) { query = arg; hasQuery = true; }
+        else { std::cerr << "Unexpected argument " << arg << "\n"; return 1; }
+    }
+    if (!hasQuery && mode != "reorganize" && mode != "pack-row-hashes" && mode != "backfill" && mode != "install-triggers"
+        && mode != "warmup") { std::cerr << "Missing query\n"; return 1; }
+
+    // Written on return; servers also rewrite it every few seconds
+    struct TraceOnExit {
+        std::string path;
+        ~TraceOnExit() { if (!path.empty()) tracer().write(path); }
+    } traceOnExit{ traceFile };
+    if (!traceFile.empty()) {
+        tracer().start();
+        trace_thread_name("main");
+        if (mode == "serve") std::thread(dump_trace, traceFile).detach();
+    }
+
+    ShardManifest manifest;
+    bool sharded = load_shard_manifest(dbFile, manifest);
+    if (sharded && manifest.table != table) { std::cerr << dbFile << " shards table " << manifest.table << ", not " << table << "\n"; return 1; }
+
+    if (mode == "serve") {
+        if (sharded) { std::cerr << "Serve each shard file and put coordinate in front of them\n"; return 1; }
+#ifdef _WIN32
+        std::cerr << "Server mode needs Unix domain sockets and is not available on Windows\n";
+        return 1;
+#else
+        return serve(dbFile, table, query, metricsFile);
+#endif
+    }
+    if (mode == "coordinate") {
+#ifdef _WIN32
+        std::cerr << "Coordinator mode needs Unix domain sockets and is not available on Windows\n";
+        return 1;
+#else
+        if (sharded) {
+            if (shards.size() != manifest.files.size()) {
+                std::cerr << dbFile << " lists " << manifest.files.size() << " shards but --shards names " << shards.size() << "\n";
+                return 1;
+            }
+            routed = manifest.routed;
+        }
+        return coordinate(table, query, shards, routed, timeoutMs);
+#endif
+    }
+
+    if (mode == "phone" || mode == "address" || mode == "hash") {
+        Engine engine;
+        if (!engine.open(dbFile, table)) { std::cerr << engine.error << "\n"; return 1; }
+        std::vector<std::map<std::string, std::string>> rows;
+        int found = engine.lookup(mode, query, [&](const std::map<std::string, std::string>& r) { rows.push_back(r); return true; }, columns);
+        std::cerr << engine.warnings();
+        if (found < 0) return 1;
+        print_rows(rows, query, jsonOut);
+        return 0;
+    }
+    if (sharded) { std::cerr << dbFile << " is a shard manifest; run " << mode << " on each shard\n"; return 1; }
+
+    sqlite3* db;
+    if (!open_database(dbFile, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, &db)) return 1;
+    bool writes = mode == "install-triggers" || mode == "backfill" || mode == "ingest" || mode == "reorganize"
+        || mode == "pack-row-hashes" || (mode == "build-index" && (query == "sql" || query == "expr"));
+    if (writes) {
+        // Maintenance runs in WAL mode so lookups and servers keep reading
+        // snapshots; only an initial load into a new table of a database
+        // not yet in WAL mode goes unjournaled
+        WalCheckpointer wal;
+        if (mode == "ingest" && journal_mode(db) != "wal") {
+            sqlite3_stmt* st;
+            sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?", -1, &st, nullptr);
+            sqlite3_bind_text(st, 1, table.c_str(), -1, SQLITE_TRANSIENT);
+            ingest.unjournaled = sqlite3_step(st) != SQLITE_ROW;
+            sqlite3_finalize(st);
+        }
+        int rc = 1;
+        if (!ingest.unjournaled && !wal.start(db, dbFile)) rc = 1;
+        else if (mode == "install-triggers") rc = install_triggers(db, table, ingest.hashCols);
+        else if (mode == "backfill") rc = backfill_table(db, table, ingest.hashCols, ingest.txRows, verify);
+        else if (mode == "ingest") rc = ingest_file(db, table, query, ingest);
+        else if (mode == "reorganize") rc = reorganize_table(db, table, build);
+        else if (mode == "pack-row-hashes") rc = pack_row_hashes(db, table);
+        else if (query == "sql") rc = build_sql_indexes(db, table, read_table_schema(db, table), cover);
+        else rc = build_expr_indexes(db, table, sources);
+        wal.stop();
+        sqlite3_close(db);
+        return rc;
+    }
+    if (mode == "shard") {
+        int rc = shard_table(db, dbFile, table, std::atoll(query.c_str()), shardKey, outDir, build);
+        sqlite3_close(db);
+        return rc;
+    }
+    if (mode == "warmup") {
+        int rc = warmup(db, dbFile, table, warm);
+        sqlite3_close(db);
+        return rc;
+    }
+    if (mode == "build-index") {
+        TableSchema schema = read_table_schema(db, table);
+        int rc = 1;
+        if (query == "mphf") rc = build_mphf_index(db, dbFile, table, schema);
+        else if (query == "prefix") rc = build_prefix_index(db, dbFile, table, schema, build);
+        else std::cerr << "Unknown index kind\n";
+        sqlite3_close(db);
+        return rc;
+    }
+    std::cerr << "Unknown mode\n";
+    sqlite3_close(db);
+    return 1;
+}
+
+#ifndef LOOKUP_LIBRARY
+#ifdef _WIN32
+int wmain(int argc, wchar_t** wargv) {
     std::vector<std::string> args;
     for (int j = 0; j < argc; ++j) args.push_back(utf8_from_wide(wargv[j]));
     std::vector<char*> cargs;
@@ -347,3 +5421,4 @@ int wmain(int argc, wchar_t** wargv) {
 #else
 int main(int argc, char** argv) { return run(argc, argv); }
 #endif
+#endif
@@ -0,0 +1,339 @@
+﻿// lookup_client.h — header-only clients for the server's binary protocol
+// and, on Linux, its shared-memory result transport
+// Usage: lookup::Client c; c.connect("/tmp/lookup.sock");
+//        uint32_t id = c.submit(lookup::Op::Rowids, digests, n);  // repeat to pipeline
+//        lookup::Response r; while (c.pending() && c.receive(r)) { ... r.id ... }
+//
+//        lookup::SharedMemoryClient m; m.connect("/tmp/lookup.sock");
+//        m.request("address", "main street"); m.next(data, size);  // JSON lines, read in place
+// POSIX only (Unix domain sockets), C++17. The frame and ring layouts are
+// described next to serve_binary() and ResultRing in DB_Hash_Lookup.cpp.
+
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace lookup {
+
+enum class Op : uint8_t { Rowids = 1, Rows = 2 };
+
+struct Response {
+    uint32_t id = 0;
+    bool ok = false;
+    std::string error;                           // when !ok
+    std::vector<std::vector<int64_t>> rowids;    // per digest, for Op::Rowids
+    std::vector<std::vector<std::string>> rows;  // per digest, JSON objects, for Op::Rows
+};
+
+// One pipelined connection. Requests are buffered by submit() and sent by
+// flush() or receive(); responses arrive in completion order, not in the
+// order submitted. Not thread-safe: use one Client per thread.
+class Client {
+public:
+    Client() = default;
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+    ~Client() { close(); }
+
+    bool connect(const std::string& socketPath) {
+        close();
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) { error = "socket path too long"; return false; }
+        std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            error = std::strerror(errno);
+            close();
+            return false;
+        }
+        out_.assign("LKUPBIN1");
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        out_.clear();
+        in_.clear();
+        ops_.clear();
+    }
+
+    // Queue a request for count (at most 65535) 32-byte digests; returns its id
+    uint32_t submit(Op op, const unsigned char* digests, size_t count) {
+        uint32_t id = nextId_++;
+        put_u32(out_, static_cast<uint32_t>(8 + count * 32));
+        put_u32(out_, id);
+        out_.push_back(static_cast<char>(op));
+        out_.push_back(0);
+        out_.push_back(static_cast<char>(count & 0xFF));
+        out_.push_back(static_cast<char>(count >> 8));
+        out_.append(reinterpret_cast<const char*>(digests), count * 32);
+        ops_[id] = op;
+        return id;
+    }
+
+    // Send everything queued; false if the connection failed
+    bool flush() {
+        while (!out_.empty())
+            if (!pump()) return false;
+        return true;
+    }
+
+    // Next response in completion order, sending queued requests meanwhile
+    // so a long pipeline cannot stall; false if the connection failed
+    bool receive(Response& r) {
+        for (;;) {
+            if (in_.size() >= 4 && in_.size() >= 4 + get_u32(in_.data())) return parse(r);
+            if (!pump()) return false;
+        }
+    }
+
+    // Submitted requests whose responses have not been received yet
+    size_t pending() const { return ops_.size(); }
+
+    std::string error;
+
+private:
+    static void put_u32(std::string& out, uint32_t v) {
+        for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+    }
+
+    static uint32_t get_u32(const char* p) {
+        uint32_t v = 0;
+        for (int i = 3; i >= 0; --i) v = v << 8 | static_cast<unsigned char>(p[i]);
+        return v;
+    }
+
+    // Wait until the socket can make progress, then write and read what it can
+    bool pump() {
+        if (fd_ < 0) { error = "not connected"; return false; }
+        pollfd pfd{ fd_, static_cast<short>(POLLIN | (out_.empty() ? 0 : POLLOUT)), 0 };
+        if (::poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) return true;
+            error = std::strerror(errno);
+            return false;
+        }
+        if (pfd.revents & POLLOUT) {
+            // Never block in send: the server may be waiting for us to read
+#ifdef MSG_NOSIGNAL
+            ssize_t n = ::send(fd_, out_.data(), out_.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+            ssize_t n = ::send(fd_, out_.data(), out_.size(), MSG_DONTWAIT);
+#endif
+            if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) { error = std::strerror(errno); return false; }
+            if (n > 0) out_.erase(0, static_cast<size_t>(n));
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            char chunk[65536];
+            ssize_t n = ::recv(fd_, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (n == 0) { error = "connection closed"; return false; }
+            if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) { error = std::strerror(errno); return false; }
+            if (n > 0) in_.append(chunk, static_cast<size_t>(n));
+        }
+        return true;
+    }
+
+    // Decode the complete frame at the front of in_
+    bool parse(Response& r) {
+        uint32_t size = get_u32(in_.data());
+        r = Response();
+        r.id = get_u32(in_.data() + 4);
+        r.ok = in_[8] == 0;
+        const char* p = in_.data() + 9;
+        const char* end = in_.data() + 4 + size;
+        auto it = ops_.find(r.id);
+        Op op = it == ops_.end() ? Op::Rowids : it->second;
+        if (it != ops_.end()) ops_.erase(it);
+        bool good = true;
+        if (!r.ok) r.error.assign(p, end);
+        while (r.ok && good && p < end) {
+            good = end - p >= 4;
+            uint32_t count = good ? get_u32(p) : 0;
+            p += good ? 4 : 0;
+            if (op == Op::Rowids) {
+                good = good && static_cast<size_t>(end - p) >= count * size_t(8);
+                std::vector<int64_t> ids;
+                for (uint32_t i = 0; good && i < count; ++i, p += 8)
+                    ids.push_back(static_cast<int64_t>(uint64_t(get_u32(p)) | uint64_t(get_u32(p + 4)) << 32));
+                r.rowids.push_back(std::move(ids));
+            }
+            else {
+                std::vector<std::string> rows;
+                for (uint32_t i = 0; good && i < count; ++i) {
+                    good = end - p >= 4 && static_cast<size_t>(end - p - 4) >= get_u32(p);
+                    if (!good) break;
+                    rows.emplace_back(p + 4, get_u32(p));
+                    p += 4 + get_u32(p);
+                }
+                r.rows.push_back(std::move(rows));
+            }
+        }
+        in_.erase(0, 4 + size);
+        if (!good) { error = "malformed response"; return false; }
+        return true;
+    }
+
+    int fd_ = -1;
+    uint32_t nextId_ = 1;
+    std::string out_, in_;
+    std::unordered_map<uint32_t, Op> ops_;   // op of each pending request, to decode its response
+};
+
+#ifdef __linux__
+// Text requests whose responses the server writes into a shared-memory ring
+// instead of the socket. Responses come back in request order. Each one
+// stays valid, in place, until the next call to next(). Not thread-safe.
+class SharedMemoryClient {
+public:
+    SharedMemoryClient() = default;
+    SharedMemoryClient(const SharedMemoryClient&) = delete;
+    SharedMemoryClient& operator=(const SharedMemoryClient&) = delete;
+    ~SharedMemoryClient() { close(); }
+
+    bool connect(const std::string& socketPath) {
+        close();
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path)) { error = "socket path too long"; return false; }
+        std::memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 || ::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || !send_all("LKUPSHM1", 8)) {
+            error = std::strerror(errno);
+            close();
+            return false;
+        }
+        // The server answers with the ring size and its memfd and eventfd
+        uint64_t size = 0;
+        iovec iov{ &size, sizeof(size) };
+        alignas(cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = ::recvmsg(fd_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        cmsghdr* c = n == static_cast<ssize_t>(sizeof(size)) ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (!c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+            error = "server did not set up a shared-memory ring";
+            close();
+            return false;
+        }
+        int fds[2];
+        std::memcpy(fds, CMSG_DATA(c), sizeof(fds));
+        memfd_ = fds[0];
+        efd_ = fds[1];
+        mapped_ = kDataOffset + size;
+        void* p = ::mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_SHARED, memfd_, 0);
+        if (p == MAP_FAILED) { error = std::strerror(errno); close(); return false; }
+        base_ = static_cast<char*>(p);
+        size_ = size;
+        return true;
+    }
+
+    void close() {
+        if (base_) ::munmap(base_, mapped_);
+        for (int f : { fd_, memfd_, efd_ })
+            if (f >= 0) ::close(f);
+        fd_ = memfd_ = efd_ = -1;
+        base_ = nullptr;
+        held_ = 0;
+    }
+
+    // Send one request; its response is read with next()
+    bool request(const std::string& mode, const std::string& query) {
+        std::string line = mode + '\t' + query + '\n';
+        if (!send_all(line.data(), line.size())) { error = std::strerror(errno); return false; }
+        return true;
+    }
+
+    // Next response: one JSON object per row, one per line, then an empty
+    // line. Releases the previous response first.
+    bool next(const char*& data, size_t& size) {
+        release();
+        uint64_t desc[2];
+        if (!recv_all(desc, sizeof(desc))) return false;
+        if (desc[0] == ~uint64_t(0)) {
+            // Larger than the ring: sent inline
+            inline_.resize(desc[1]);
+            if (!recv_all(&inline_[0], inline_.size())) return false;
+            data = inline_.data();
+        }
+        else {
+            data = base_ + kDataOffset + desc[0] % size_;
+            held_ = desc[0] + desc[1];
+        }
+        size = static_cast<size_t>(desc[1]);
+        return true;
+    }
+
+    std::string error;
+
+private:
+    // Matches ShmRingHeader in DB_Hash_Lookup.cpp
+    struct RingHeader {
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        alignas(64) std::atomic<uint32_t> waiting;
+    };
+    static const size_t kDataOffset = 4096;
+
+    RingHeader* header() const { return reinterpret_cast<RingHeader*>(base_); }
+
+    // Give the held response's space back, waking the server if it waits for it
+    void release() {
+        if (!held_) return;
+        header()->tail.store(held_);
+        held_ = 0;
+        if (header()->waiting.load()) {
+            uint64_t one = 1;
+            while (::write(efd_, &one, sizeof(one)) < 0 && errno == EINTR) {}
+        }
+    }
+
+    bool send_all(const char* p, size_t n) {
+        while (n) {
+            ssize_t w = ::send(fd_, p, n, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return false;
+            p += w;
+            n -= static_cast<size_t>(w);
+        }
+        return true;
+    }
+
+    bool recv_all(void* out, size_t n) {
+        char* p = static_cast<char*>(out);
+        while (n) {
+            ssize_t r = ::recv(fd_, p, n, 0);
+            if (r < 0 && errno == EINTR) continue;
+            if (r <= 0) { error = r == 0 ? "connection closed" : std::strerror(errno); return false; }
+            p += r;
+            n -= static_cast<size_t>(r);
+        }
+        return true;
+    }
+
+    int fd_ = -1, memfd_ = -1, efd_ = -1;
+    char* base_ = nullptr;
+    size_t mapped_ = 0;
+    uint64_t size_ = 0;
+    uint64_t held_ = 0;          // end of the response handed out by next(), 0 when none
+    std::string inline_;
+};
+#endif
+
+}  // namespace lookup
@@ -0,0 +1,52 @@
+﻿// lookup_engine.h — C interface to the lookup engine in DB_Hash_Lookup.cpp
+// Build it as a library by leaving out main():
+//   g++ -std=c++17 -O2 -pthread -fPIC -shared -fvisibility=hidden -DLOOKUP_LIBRARY DB_Hash_Lookup.cpp -lsqlite3 -lcrypto -o liblookup.so
+// One engine may be shared by any number of threads.
+
+#pragma once
+
+#include <stddef.h>
+
+#if defined(_WIN32) && defined(LOOKUP_LIBRARY)
+#define LOOKUP_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define LOOKUP_API __attribute__((visibility("default")))
+#else
+#define LOOKUP_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct lookup_engine lookup_engine;
+
+// Errors returned by lookup_engine_lookup
+#define LOOKUP_ERR_MODE (-1)       // mode is not phone, address or hash
+#define LOOKUP_ERR_DATABASE (-2)   // no connection to the database could be opened
+
+// Receives one matching row: its column names and values as UTF-8 text,
+// valid only during the call. Return 0 to stop the lookup early.
+typedef int (*lookup_row_fn)(void* ctx, int ncols, const char* const* names, const char* const* values);
+
+// Open a database file, or a .shards manifest, for lookups in table.
+// Returns NULL on failure and copies the reason into err when it is given.
+LOOKUP_API lookup_engine* lookup_engine_open(const char* path, const char* table, char* err, size_t err_size);
+
+// Look up query in mode "phone", "address" or "hash". columns is a
+// comma-separated projection, or NULL for every column. Returns the
+// number of rows passed to sink, or a LOOKUP_ERR_ code.
+LOOKUP_API int lookup_engine_lookup(lookup_engine* engine, const char* mode, const char* query, const char* columns,
+    lookup_row_fn sink, void* ctx);
+
+// Side index files recent lookups ignored as stale, one "Ignoring stale
+// index <path>" line each, then the last transaction statement that failed
+// (a LOOKUP_ERR_DATABASE result) with SQLite's message. Copies as much as
+// fits into buf and returns the full length; 0 means no warnings.
+LOOKUP_API size_t lookup_engine_warnings(lookup_engine* engine, char* buf, size_t size);
+
+LOOKUP_API void lookup_engine_close(lookup_engine* engine);
+
+#ifdef __cplusplus
+}
+#endif
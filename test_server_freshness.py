@@ -0,0 +1,121 @@
+import hashlib
+import os
+import shutil
+import socket
+import sqlite3
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+# Commits rows from another connection while the server runs and looks each
+# one up right after the commit. The server must return it every time, even
+# before its in-memory index has caught up with the commit. Both the text
+# protocol and the binary one (rowids) are checked.
+#
+#   python3 test_server_freshness.py ./DB_Lookup
+
+def sha256_hex(s: str) -> str:
+    return hashlib.sha256(s.encode("utf-8")).hexdigest()
+
+def request(sock, mode: str, query: str):
+    sock.sendall(f"{mode}\t{query}\n".encode("utf-8"))
+    buf = b""
+    while not buf.endswith(b"\n\n") and buf != b"\n":
+        chunk = sock.recv(65536)
+        if not chunk:
+            raise RuntimeError("server closed the connection")
+        buf += chunk
+    return [line for line in buf.decode("utf-8").split("\n") if line]
+
+def recv_exact(sock, n: int) -> bytes:
+    buf = b""
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise RuntimeError("server closed the connection")
+        buf += chunk
+    return buf
+
+def binary_rowids(sock, request_id: int, digest: bytes):
+    body = struct.pack("<IBBH", request_id, 1, 0, 1) + digest
+    sock.sendall(struct.pack("<I", len(body)) + body)
+    size, = struct.unpack("<I", recv_exact(sock, 4))
+    reply = recv_exact(sock, size)
+    rid, status = struct.unpack_from("<IB", reply)
+    if rid != request_id or status != 0:
+        raise RuntimeError(f"binary request {request_id} failed: {reply[5:]!r}")
+    count, = struct.unpack_from("<I", reply, 5)
+    return list(struct.unpack_from(f"<{count}q", reply, 9))
+
+def main(binary: str) -> int:
+    work = tempfile.mkdtemp()
+    db_path = os.path.join(work, "fresh.db")
+    sock_path = os.path.join(work, "fresh.sock")
+
+    conn = sqlite3.connect(db_path)
+    conn.execute("PRAGMA journal_mode=WAL")
+    conn.execute("CREATE TABLE people(name, phone, name_sha256, phone_sha256)")
+    conn.executemany("INSERT INTO people VALUES(?,?,?,?)",
+                     [(f"user{i}", f"+7999{i:07d}", sha256_hex(f"user{i}"), sha256_hex(f"+7999{i:07d}"))
+                      for i in range(1000)])
+    conn.execute("CREATE INDEX ix_name ON people(name_sha256)")
+    conn.commit()
+
+    server = subprocess.Popen([binary, db_path, "people", "serve", sock_path],
+                              stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    failures = 0
+    try:
+        # Wait until the in-memory index is built, so misses are answered from it
+        for line in server.stdout:
+            if line.startswith("Cuckoo index ready"):
+                break
+        else:
+            print("server exited before its index was ready")
+            return 1
+        sock = socket.socket(socket.AF_UNIX)
+        for _ in range(100):
+            try:
+                sock.connect(sock_path)
+                break
+            except OSError:
+                time.sleep(0.05)
+        bsock = socket.socket(socket.AF_UNIX)
+        bsock.connect(sock_path)
+        bsock.sendall(b"LKUPBIN1")
+
+        if len(request(sock, "hash", "user5")) != 1:
+            print("existing row not found")
+            failures += 1
+        for i in range(50):
+            name = f"fresh{i}"
+            rowid = conn.execute("INSERT INTO people VALUES(?,?,?,?)", (name, "", sha256_hex(name), None)).lastrowid
+            conn.commit()
+            rows = request(sock, "hash", name)
+            if len(rows) != 1 or name not in rows[0]:
+                print(f"{name}: expected 1 row right after the commit, got {rows}")
+                failures += 1
+            rowids = binary_rowids(bsock, i, hashlib.sha256(name.encode("utf-8")).digest())
+            if rowids != [rowid]:
+                print(f"{name}: expected rowid {rowid} over the binary protocol, got {rowids}")
+                failures += 1
+            if i % 10 == 9:
+                time.sleep(1.5)   # let the index catch up, then commit again
+        # Once caught up, the index must hold the new rows and still miss the rest
+        time.sleep(1.5)
+        if len(request(sock, "hash", "fresh0")) != 1 or request(sock, "hash", "nobody"):
+            print("lookups wrong after the index caught up")
+            failures += 1
+        sock.close()
+        bsock.close()
+    finally:
+        server.terminate()
+        server.wait()
+        conn.close()
+        shutil.rmtree(work, ignore_errors=True)
+    print("ok" if failures == 0 else f"{failures} failures")
+    return 1 if failures else 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1] if len(sys.argv) > 1 else "./DB_Lookup"))